@@ -0,0 +1,109 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../proto/dav/parser.h"
+
+
+/* xmlParserTime against the strptime + mktime it replaced, on the same
+ * random dates of both formats. Run with `make bench`. */
+
+#define BENCH_DATES 65536
+#define BENCH_ROUNDS 16
+#define BENCH_VALUE_MAX 40
+
+
+struct BenchFormat {
+  const char *dt;
+  const char *strftime;
+  const char *strptime;
+};
+
+static const struct BenchFormat bench_formats[] = {
+  {"dateTime.rfc1123", "%a, %d %b %Y %H:%M:%S GMT", "%a, %d %b %Y %T GMT"},
+  {"dateTime.tz", "%Y-%m-%dT%H:%M:%SZ", "%FT%TZ"},
+};
+
+
+static char bench_values[BENCH_DATES][BENCH_VALUE_MAX];
+static time_t bench_expected[BENCH_DATES];
+/* keeps the loops from being optimized out */
+static volatile time_t bench_sink;
+
+
+static inline double bench_now (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static time_t bench_strptime (const char *value, const char *format) {
+  struct tm tm = {0};
+  if (strptime(value, format, &tm) == NULL) {
+    return 0;
+  }
+  return mktime(&tm) - timezone;
+}
+
+
+static int bench_format (const struct BenchFormat *format) {
+  uint64_t seed = 0x2545f4914f6cdd1d;
+  for (int i = 0; i < BENCH_DATES; i++) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    /* 1970 to 2100 */
+    bench_expected[i] = (time_t) ((seed >> 16) % 4102444800ull);
+    struct tm tm;
+    gmtime_r(&bench_expected[i], &tm);
+    strftime(bench_values[i], BENCH_VALUE_MAX, format->strftime, &tm);
+  }
+
+  int mismatches = 0;
+  for (int i = 0; i < BENCH_DATES; i++) {
+    if (xmlParserTime(bench_values[i], format->dt) != bench_expected[i]) {
+      if (mismatches++ < 4) {
+        fprintf(stderr, "%s: %s parsed as %ld\n", format->dt, bench_values[i],
+                (long) xmlParserTime(bench_values[i], format->dt));
+      }
+    }
+  }
+
+  double start = bench_now();
+  for (int round = 0; round < BENCH_ROUNDS; round++) {
+    for (int i = 0; i < BENCH_DATES; i++) {
+      bench_sink = xmlParserTime(bench_values[i], format->dt);
+    }
+  }
+  double parser = (bench_now() - start) / BENCH_ROUNDS / BENCH_DATES * 1e9;
+
+  start = bench_now();
+  for (int round = 0; round < BENCH_ROUNDS; round++) {
+    for (int i = 0; i < BENCH_DATES; i++) {
+      bench_sink = bench_strptime(bench_values[i], format->strptime);
+    }
+  }
+  double libc = (bench_now() - start) / BENCH_ROUNDS / BENCH_DATES * 1e9;
+
+  printf("%-18s xmlParserTime %8.1f ns   strptime+mktime %8.1f ns   x%.1f\n",
+         format->dt, parser, libc, libc / parser);
+  return mismatches;
+}
+
+
+int main (void) {
+  tzset();
+
+  int mismatches = 0;
+  for (size_t i = 0; i < sizeof(bench_formats) / sizeof(bench_formats[0]); i++) {
+    mismatches += bench_format(&bench_formats[i]);
+  }
+  if (mismatches) {
+    fprintf(stderr, "%d dates parsed wrong\n", mismatches);
+    return 1;
+  }
+  return 0;
+}
@@ -175,4 +175,4 @@ xcrc32 (const unsigned char *buf, int len, unsigned int init)
   return crc;
 }
 
-extern inline unsigned int crc32 (const unsigned char *buf, int len);
+extern inline unsigned int crc32_calc (const unsigned char *buf, int len);
@@ -4,7 +4,7 @@
 unsigned int xcrc32 (const unsigned char *buf, int len, unsigned int init);
 
 
-inline unsigned int crc32 (const unsigned char *buf, int len) {
+inline unsigned int crc32_calc (const unsigned char *buf, int len) {
   return xcrc32(buf, len, 0xffffffff);
 }
 
@@ -50,7 +50,7 @@ void VTable_rand_init (void);
 int __attribute__((noreturn)) VTable_crash (void);
 
 inline unsigned int VTable_checksum (const struct VTable *this, unsigned int size) {
-  return crc32(
+  return crc32_calc(
     ((const unsigned char *) this) + sizeof(struct VTable),
     size - sizeof(struct VTable)
   ) ^ VTable_rand;
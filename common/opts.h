@@ -11,6 +11,11 @@ struct networkfs_opts {
   CURLU *baseurl;
   char *username;
   char *password;
+  long httpauth;
+  bool cookies;
+  long expect_threshold;
+  bool compress;
+  bool compress_data;
   long use_ssl;
   long ssl_version;
   long ip_version;
@@ -26,6 +31,24 @@ struct networkfs_opts {
   long timeout;
   long connect_timeout;
   long initial_timeout;
+  long meta_timeout;
+  long data_timeout;
+
+  long pool_max;
+  long pool_min;
+  long pool_idle_timeout;
+
+  bool hedge;
+  long hedge_delay;
+  long retries;
+  long retry_delay;
+
+  long breaker_threshold;
+  long breaker_probe;
+
+  char *tls_session_cache;
+  bool tcp_fastopen;
+  bool early_data;
 
   bool no_verify_hostname;
   bool no_verify_peer;
@@ -46,6 +69,13 @@ struct networkfs_opts {
   bool proxytunnel;
 
   bool use_lock;
+  bool use_etag;
+  long lock_timeout;
+  long lock_linger;
+  long defer_create;
+  double save_delay;
+  double attr_delay;
+  bool writeback_cache;
 };
 
 
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <grammar/try.h>
+#include <grammar/malloc.h>
+#include "arena.h"
+
+
+extern inline ArenaMark Arena_mark (const Arena *this);
+extern inline int Arena_init (Arena *this, size_t block_size);
+
+
+void *Arena_alloc (Arena *this, size_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+  ArenaBlock *block = this->block;
+  if unlikely (block == NULL || block->size - block->used < size) {
+    size_t block_size = size > this->block_size ? size : this->block_size;
+    block = malloc(sizeof(ArenaBlock) + block_size);
+    should (block) otherwise {
+      MallocException("arena block");
+      return NULL;
+    }
+    block->prev = this->block;
+    block->size = block_size;
+    block->used = 0;
+    this->block = block;
+  }
+
+  void *ret = block->data + block->used;
+  block->used += size;
+  return ret;
+}
+
+
+char *Arena_strdup (Arena *this, const char *s) {
+  size_t len = strlen(s) + 1;
+  char *ret = Arena_alloc(this, len);
+  if likely (ret) {
+    memcpy(ret, s, len);
+  }
+  return ret;
+}
+
+
+char *Arena_vprintf (Arena *this, const char *format, va_list ap) {
+  va_list ap_len;
+  va_copy(ap_len, ap);
+  int len = vsnprintf(NULL, 0, format, ap_len);
+  va_end(ap_len);
+
+  char *ret = Arena_alloc(this, len + 1);
+  if likely (ret) {
+    vsnprintf(ret, len + 1, format, ap);
+  }
+  return ret;
+}
+
+
+char *Arena_printf (Arena *this, const char *format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  char *ret = Arena_vprintf(this, format, ap);
+  va_end(ap);
+  return ret;
+}
+
+
+void Arena_rewind (Arena *this, ArenaMark mark) {
+  while (this->block != mark.block) {
+    ArenaBlock *block = this->block;
+    if (block->prev == NULL && mark.block == NULL) {
+      /* keep the oldest block for the next user */
+      block->used = 0;
+      return;
+    }
+    this->block = block->prev;
+    free(block);
+  }
+
+  if (this->block) {
+    this->block->used = mark.used;
+  }
+}
+
+
+void Arena_destory (Arena *this) {
+  PROTECT_RETURN(this);
+
+  while (this->block) {
+    ArenaBlock *block = this->block;
+    this->block = block->prev;
+    free(block);
+  }
+}
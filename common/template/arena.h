@@ -0,0 +1,56 @@
+#ifndef NETWORKFS_ARENA_H
+#define NETWORKFS_ARENA_H
+
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <grammar/class.h>
+#include <grammar/with.h>
+
+
+#define ARENA_ALIGN 16
+
+
+typedef struct ArenaBlock {
+  struct ArenaBlock *prev;
+  size_t size;
+  size_t used;
+  _Alignas(ARENA_ALIGN) char data[];
+} ArenaBlock;
+
+/* Bump allocator for short lived allocations, freed all at once by
+ * rewinding to a mark. The oldest block is kept on rewind, so a long lived
+ * arena stops calling malloc once it is warm. */
+typedef struct Arena {
+  ArenaBlock *block;
+  size_t block_size;
+} Arena;
+
+typedef struct ArenaMark {
+  ArenaBlock *block;
+  size_t used;
+} ArenaMark;
+
+
+void *Arena_alloc (Arena *this, size_t size);
+char *Arena_strdup (Arena *this, const char *s);
+char *Arena_vprintf (Arena *this, const char *format, va_list ap);
+char *Arena_printf (Arena *this, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+inline ArenaMark Arena_mark (const Arena *this) {
+  return (ArenaMark) {this->block, this->block ? this->block->used : 0};
+}
+
+void Arena_rewind (Arena *this, ArenaMark mark);
+#define with_arena_mark(arena) with (ArenaMark __arena_mark = Arena_mark(arena), Arena_rewind(arena, __arena_mark))
+
+void Arena_destory (Arena *this);
+
+inline int Arena_init (Arena *this, size_t block_size) {
+  this->block = NULL;
+  this->block_size = block_size;
+  return 0;
+}
+
+
+#endif /* NETWORKFS_ARENA_H */
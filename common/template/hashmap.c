@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+
+#define HASHMAP_INITIAL_BUCKETS 16
+
+
+extern inline size_t HashMap_hash (const char *key);
+extern inline HashMapShard *HashMap_shard (HashMap *this, size_t hash);
+
+
+HashMapEntry *HashMapShard_find (HashMapShard *this, const char *key, size_t hash) {
+  if unlikely (this->nbucket == 0) {
+    return NULL;
+  }
+
+  for (HashMapEntry *entry = this->buckets[hash % this->nbucket]; entry; entry = entry->next) {
+    if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+
+static int HashMapShard_resize (HashMapShard *this, size_t nbucket) {
+  HashMapEntry **buckets = calloc(nbucket, sizeof(HashMapEntry *));
+  if unlikely (buckets == NULL) {
+    return 1;
+  }
+
+  for (size_t i = 0; i < this->nbucket; i++) {
+    for (HashMapEntry *entry = this->buckets[i], *next; entry; entry = next) {
+      next = entry->next;
+      entry->next = buckets[entry->hash % nbucket];
+      buckets[entry->hash % nbucket] = entry;
+    }
+  }
+
+  free(this->buckets);
+  this->buckets = buckets;
+  this->nbucket = nbucket;
+  return 0;
+}
+
+
+int HashMapShard_insert (HashMapShard *this, HashMapEntry *entry) {
+  if unlikely (this->size >= this->nbucket) {
+    if (HashMapShard_resize(this, this->nbucket ? this->nbucket * 2 : HASHMAP_INITIAL_BUCKETS) &&
+        this->nbucket == 0) {
+      return 1;
+    }
+  }
+
+  HashMapEntry **bucket = &this->buckets[entry->hash % this->nbucket];
+  entry->next = *bucket;
+  *bucket = entry;
+  this->size++;
+  return 0;
+}
+
+
+HashMapEntry *HashMapShard_remove (HashMapShard *this, const char *key, size_t hash) {
+  if unlikely (this->nbucket == 0) {
+    return NULL;
+  }
+
+  for (HashMapEntry **entry_p = &this->buckets[hash % this->nbucket]; *entry_p; entry_p = &(*entry_p)->next) {
+    HashMapEntry *entry = *entry_p;
+    if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+      *entry_p = entry->next;
+      entry->next = NULL;
+      this->size--;
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+
+void HashMap_destory (HashMap *this, HashMap_free_t free_entry) {
+  for (int i = 0; i < HASHMAP_SHARDS; i++) {
+    HashMapShard *shard = &this->shards[i];
+    if (free_entry) {
+      foreach(HashMapShard) (entry, shard) {
+        free_entry(entry);
+      }
+    }
+    free(shard->buckets);
+    shard->buckets = NULL;
+    shard->nbucket = 0;
+    shard->size = 0;
+    pthread_mutex_destroy(&shard->lock);
+  }
+}
+
+
+int HashMap_init (HashMap *this) {
+  for (int i = 0; i < HASHMAP_SHARDS; i++) {
+    HashMapShard *shard = &this->shards[i];
+    shard->buckets = NULL;
+    shard->nbucket = 0;
+    shard->size = 0;
+    pthread_mutex_init(&shard->lock, NULL);
+  }
+  return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef NETWORKFS_HASHMAP_H
+#define NETWORKFS_HASHMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include <grammar/class.h>
+#include <grammar/foreach.h>
+
+
+#define HASHMAP_SHARDS 16
+
+
+/* Intrusive entry, embed it as the first member. The key is owned by the
+ * embedding structure. */
+typedef struct HashMapEntry {
+  struct HashMapEntry *next;
+  size_t hash;
+  const char *key;
+} HashMapEntry;
+
+typedef struct HashMapShard {
+  pthread_mutex_t lock;
+  HashMapEntry **buckets;
+  size_t nbucket;
+  size_t size;
+} HashMapShard;
+
+typedef struct HashMap {
+  HashMapShard shards[HASHMAP_SHARDS];
+} HashMap;
+
+typedef void (*HashMap_free_t) (HashMapEntry *);
+
+
+inline size_t HashMap_hash (const char *key) {
+  /* FNV-1a */
+  size_t hash = 14695981039346656037ULL;
+  for (; *key != '\0'; key++) {
+    hash ^= (unsigned char) *key;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+inline HashMapShard *HashMap_shard (HashMap *this, size_t hash) {
+  return &this->shards[(hash >> 32 ^ hash) % HASHMAP_SHARDS];
+}
+
+/* The shard functions below expect the shard lock to be held. */
+HashMapEntry *HashMapShard_find (HashMapShard *this, const char *key, size_t hash);
+int HashMapShard_insert (HashMapShard *this, HashMapEntry *entry);
+HashMapEntry *HashMapShard_remove (HashMapShard *this, const char *key, size_t hash);
+
+#define foreach_HashMapShard(varname, shard) \
+  for (size_t __bucket_ ## varname = 0; __bucket_ ## varname < (shard)->nbucket; __bucket_ ## varname++) \
+    for (HashMapEntry *varname = (shard)->buckets[__bucket_ ## varname], *__next_ ## varname; \
+         varname && (__next_ ## varname = varname->next, 1); varname = __next_ ## varname)
+
+void HashMap_destory (HashMap *this, HashMap_free_t free_entry);
+int HashMap_init (HashMap *this);
+
+
+#endif /* NETWORKFS_HASHMAP_H */
@@ -0,0 +1,91 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <grammar/synchronized.h>
+#include "singleflight.h"
+
+
+SingleFlightCall *SingleFlight_join (SingleFlight *this, const char *key, bool *leaderp) {
+  size_t hash = HashMap_hash(key);
+  HashMapShard *shard = HashMap_shard(&this->calls, hash);
+  SingleFlightCall *call;
+
+  synchronized (mutex, &shard->lock, lock) {
+    call = (SingleFlightCall *) HashMapShard_find(shard, key, hash);
+    if (call) {
+      *leaderp = false;
+      call->followers++;
+      while (!call->done) {
+        pthread_cond_wait(&call->cond, &shard->lock);
+      }
+      break;
+    }
+
+    /* without memory the caller simply runs alone */
+    *leaderp = true;
+    size_t len = strlen(key);
+    call = malloc(sizeof(SingleFlightCall) + len + 1);
+    if unlikely (call == NULL) {
+      break;
+    }
+    memcpy(call->name, key, len + 1);
+    call->key = call->name;
+    call->hash = hash;
+    call->followers = 0;
+    call->done = false;
+    call->res = 0;
+    call->result = NULL;
+    if unlikely (HashMapShard_insert(shard, (HashMapEntry *) call)) {
+      free(call);
+      call = NULL;
+      break;
+    }
+    pthread_cond_init(&call->cond, NULL);
+  }
+
+  return call;
+}
+
+
+void SingleFlight_leave (SingleFlight *this, SingleFlightCall *call) {
+  HashMapShard *shard = HashMap_shard(&this->calls, call->hash);
+  synchronized (mutex, &shard->lock, lock) {
+    if (--call->followers == 0) {
+      pthread_cond_broadcast(&call->cond);
+    }
+  }
+}
+
+
+void SingleFlight_finish (SingleFlight *this, SingleFlightCall *call, int res, const void *result) {
+  if (call == NULL) {
+    return;
+  }
+
+  HashMapShard *shard = HashMap_shard(&this->calls, call->hash);
+  synchronized (mutex, &shard->lock, lock) {
+    /* later callers start a flight of their own */
+    HashMapShard_remove(shard, call->name, call->hash);
+    call->res = res;
+    call->result = result;
+    call->done = true;
+    pthread_cond_broadcast(&call->cond);
+    while (call->followers > 0) {
+      pthread_cond_wait(&call->cond, &shard->lock);
+    }
+  }
+
+  pthread_cond_destroy(&call->cond);
+  free(call);
+}
+
+
+void SingleFlight_destory (SingleFlight *this) {
+  /* no call is in flight any more */
+  HashMap_destory(&this->calls, NULL);
+}
+
+
+int SingleFlight_init (SingleFlight *this) {
+  return HashMap_init(&this->calls);
+}
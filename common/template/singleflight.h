@@ -0,0 +1,41 @@
+#ifndef NETWORKFS_SINGLEFLIGHT_H
+#define NETWORKFS_SINGLEFLIGHT_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "hashmap.h"
+
+
+/* A call in flight. Its leader runs it, and whoever asks for the same key
+ * meanwhile waits for the result instead. The leader does not return
+ * before every follower has read the result, so result may point into the
+ * leader's stack or buffers. */
+typedef struct SingleFlightCall {
+  HashMapEntry;
+  pthread_cond_t cond;
+  /* followers yet to read the result */
+  unsigned int followers;
+  bool done;
+  int res;
+  const void *result;
+  char name[];
+} SingleFlightCall;
+
+typedef struct SingleFlight {
+  HashMap calls;
+} SingleFlight;
+
+
+/* *leaderp tells whether the caller is to run the call and hand its result
+ * to SingleFlight_finish, the returned call may be NULL then. Followers get
+ * the finished call, to be given back with SingleFlight_leave. */
+SingleFlightCall *SingleFlight_join (SingleFlight *this, const char *key, bool *leaderp);
+void SingleFlight_leave (SingleFlight *this, SingleFlightCall *call);
+void SingleFlight_finish (SingleFlight *this, SingleFlightCall *call, int res, const void *result);
+
+void SingleFlight_destory (SingleFlight *this);
+int SingleFlight_init (SingleFlight *this);
+
+
+#endif /* NETWORKFS_SINGLEFLIGHT_H */
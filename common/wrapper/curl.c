@@ -1,6 +1,14 @@
+#include <fcntl.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include <grammar/class.h>
+#include <grammar/synchronized.h>
 #include <template/stack.h>
 #include "../networkfs.h"
 
@@ -10,16 +18,678 @@
 extern inline char *curl_easy_unescape_e (CURL *curl, const char *url, int inlength, int *outlength);
 extern inline struct curl_slist *curl_slist_append_weak (struct curl_slist *list, const char *string);
 extern inline struct curl_slist *curl_slist_append_e (struct curl_slist *list, const char *string);
+extern inline struct curl_slist *curl_slist_append_arena (Arena *arena, struct curl_slist *list, const char *string);
 extern inline CURLU *curl_url_dup_e (CURLU *in);
 extern inline CURLU *curl_url_e (void);
 extern inline CURLUcode curl_url_set_ssl (CURLU *h, int ssl_version);
 
 
-static Stack curl_handler_stack;
+/* Pooled easy handle. The list head is embedded, so returning a handle to
+ * the pool never allocates. */
+struct CurlHandle {
+  struct LinkedListHead;
+  CURL *curl;
+  time_t last_used;
+  /* among the `min` kept ones, its connection is kept alive by the reaper
+   * instead of expiring after idle_timeout */
+  bool warm;
+};
+
+static struct CurlPool {
+  /* idle handles, most recently used first */
+  Stack stack;
+  /* handle last released by the current thread, out of the reaper's
+   * reach, so it is expired by the next get of the thread instead */
+  pthread_key_t cached;
+  /* number of those, counted against max along with the stack */
+  atomic_long ncached;
+  long max;
+  long min;
+  long idle_timeout;
+  /* server the warm handles are pinged at */
+  const struct networkfs_opts *options;
+
+  pthread_once_t reaper_once;
+  pthread_t reaper;
+  pthread_mutex_t reaper_lock;
+  pthread_cond_t reaper_cond;
+  bool reaper_started;
+  bool stopping;
+} curl_pool = {
+  .max = 16,
+  .idle_timeout = 60,
+  .reaper_once = PTHREAD_ONCE_INIT,
+  .reaper_lock = PTHREAD_MUTEX_INITIALIZER,
+  .reaper_cond = PTHREAD_COND_INITIALIZER,
+};
+
+
+#define CURL_RETRY_DELAY_MAX 5000
+#define CURL_LATENCY_BUCKETS 32
+#define CURL_LATENCY_MIN_SAMPLES 16
+#define CURL_LATENCY_DECAY 4096
+
+static struct CurlPolicy {
+  bool hedge;
+  long hedge_delay;
+  long retries;
+  long retry_delay;
+  /* connection cache shared by all handles, so a hedge can run beside the
+   * original request without starting from a cold cache */
+  CURLSH *share;
+  pthread_mutex_t share_lock[CURL_LOCK_DATA_LAST];
+  /* per thread multi handle driving hedged requests */
+  pthread_key_t multi;
+  /* CURLOPT_TIMEOUT of each request class, 0 to keep the default */
+  long timeout[CURL_CLASS_MAX];
+
+  /* file the TLS session tickets are kept in across mounts */
+  char *tls_session_cache;
+  bool tcp_fastopen;
+  /* CURLOPT_SSL_OPTIONS of every request, idempotent ones may add
+   * CURLSSLOPT_EARLYDATA on top */
+  long ssl_options;
+  /* TLS 1.3 early data, only sent by idempotent requests */
+  bool early_data;
+  /* in memory cookie jar in the share, for servers with login sessions */
+  bool cookies;
+  /* smallest upload sent with Expect: 100-continue, 0 for none */
+  long expect_threshold;
+  /* CURLOPT_ACCEPT_ENCODING of each request class, "" for every encoding
+   * libcurl was built with */
+  const char *accept_encoding[CURL_CLASS_MAX];
+} curl_policy = {
+  .retries = 2,
+  .retry_delay = 100,
+};
+
+/* Health of the server, shared by every request of the mount. Once
+ * `threshold` connection errors occurred in a row the breaker opens and
+ * requests fail at once; a background prober half-opens it every `probe`
+ * seconds and closes it again when the server answers. */
+enum CurlBreakerState {
+  CURL_BREAKER_CLOSED = 0,
+  CURL_BREAKER_OPEN,
+  CURL_BREAKER_HALF_OPEN,
+};
+
+static struct CurlBreaker {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  _Atomic enum CurlBreakerState state;
+  long threshold;
+  long probe;
+  long failures;
+
+  const struct networkfs_opts *options;
+  pthread_t prober;
+  bool prober_started;
+  bool stopping;
+} curl_breaker = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+  .threshold = 3,
+  .probe = 5,
+};
+
+/* time to first byte, log2 buckets of microseconds */
+static struct CurlLatency {
+  atomic_ulong bucket[CURL_LATENCY_BUCKETS];
+  atomic_ulong count;
+} curl_latency[CURL_CLASS_MAX];
+
+struct CurlStats curl_stats;
+
+
+int curl_stats_snprint (char *buf, size_t size) {
+  int res = 0;
+#define X(s) \
+  res += snprintf(buf + res, size > (size_t) res ? size - res : 0, # s " %lu\n", (unsigned long) curl_stats.s);
+  CURL_STATS
+#undef X
+  return res;
+}
+
+
+static inline time_t curl_pool_now (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+
+static void curl_handle_free (struct CurlHandle *handle) {
+  PROTECT_RETURN(handle);
+
+  curl_easy_cleanup(handle->curl);
+  free(handle);
+}
+
+
+static inline bool curl_pool_full (void) {
+  return curl_pool.max >= 0 &&
+         curl_pool.stack.size + (size_t) curl_pool.ncached >= (size_t) curl_pool.max;
+}
+
+
+static void curl_handle_put (struct CurlHandle *handle) {
+  handle->last_used = curl_pool_now();
+
+  if unlikely (curl_pool_full()) {
+    curl_handle_free(handle);
+    return;
+  }
+  if (pthread_getspecific(curl_pool.cached) == NULL &&
+      pthread_setspecific(curl_pool.cached, handle) == 0) {
+    curl_pool.ncached++;
+    return;
+  }
+  Stack_push(&curl_pool.stack, (LinkedListHead *) handle);
+}
+
+
+static struct CurlHandle *curl_handle_get (void) {
+  struct CurlHandle *handle = pthread_getspecific(curl_pool.cached);
+  if (handle) {
+    pthread_setspecific(curl_pool.cached, NULL);
+    curl_pool.ncached--;
+    if likely (curl_pool.idle_timeout <= 0 ||
+               handle->last_used + curl_pool.idle_timeout > curl_pool_now() ||
+               curl_pool.stack.size < (size_t) curl_pool.min) {
+      return handle;
+    }
+    curl_handle_free(handle);
+  }
+  return (struct CurlHandle *) Stack_pop(&curl_pool.stack);
+}
+
+
+/* thread exit, give the cached handle back to the shared pool */
+static void curl_pool_release_cached (void *handle) {
+  curl_pool.ncached--;
+  if unlikely (curl_pool.stopping || curl_pool_full()) {
+    curl_handle_free(handle);
+    return;
+  }
+  Stack_push(&curl_pool.stack, (LinkedListHead *) handle);
+}
+
+
+/* drop handles idle for longer than idle_timeout, except the `min` most
+ * recently used ones, which are taken out to be pinged if idle for longer
+ * than interval */
+static LinkedListHead *curl_pool_reap (time_t now, time_t interval) {
+  LinkedListHead *expired = NULL;
+  LinkedListHead *idle = NULL;
+
+  synchronized (spin, &curl_pool.stack.lock, lock) {
+    long kept = 0;
+    LinkedListHead *prev = (LinkedListHead *) &curl_pool.stack;
+    while (prev->next) {
+      struct CurlHandle *handle = (struct CurlHandle *) prev->next;
+      handle->warm = kept < curl_pool.min;
+      if (handle->warm && handle->last_used + interval <= now) {
+        kept++;
+        prev->next = handle->next;
+        handle->next = idle;
+        idle = (LinkedListHead *) handle;
+        curl_pool.stack.size--;
+        continue;
+      }
+      if (handle->warm || handle->last_used + curl_pool.idle_timeout > now) {
+        kept++;
+        prev = prev->next;
+        continue;
+      }
+      prev->next = handle->next;
+      handle->next = expired;
+      expired = (LinkedListHead *) handle;
+      curl_pool.stack.size--;
+    }
+  }
+
+  while (expired) {
+    struct CurlHandle *handle = (struct CurlHandle *) expired;
+    expired = expired->next;
+    curl_handle_free(handle);
+  }
+  return idle;
+}
+
+
+/* Undo the per request options instead of curl_easy_reset(), which would
+ * also forget the negotiated authentication (the scheme picked after a
+ * challenge, the Digest nonce). Options set by callers after
+ * curl_easy_init_common() must be cleared here.
+ * libcurl keeps that state in the easy handle and cannot share it, so each
+ * pooled handle still meets one Digest challenge of its own. */
+static void curl_easy_reset_soft (CURL *this) {
+  curl_easy_setopt(this, CURLOPT_POSTFIELDS, NULL);
+  curl_easy_setopt(this, CURLOPT_POSTFIELDSIZE, -1L);
+  /* also clears CURLOPT_NOBODY and CURLOPT_UPLOAD */
+  curl_easy_setopt(this, CURLOPT_HTTPGET, 1L);
+  curl_easy_setopt(this, CURLOPT_CUSTOMREQUEST, NULL);
+  curl_easy_setopt(this, CURLOPT_HTTPHEADER, NULL);
+  curl_easy_setopt(this, CURLOPT_RANGE, NULL);
+  curl_easy_setopt(this, CURLOPT_INFILESIZE, -1L);
+  curl_easy_setopt(this, CURLOPT_READFUNCTION, NULL);
+  curl_easy_setopt(this, CURLOPT_READDATA, NULL);
+  curl_easy_setopt(this, CURLOPT_WRITEFUNCTION, NULL);
+  curl_easy_setopt(this, CURLOPT_WRITEDATA, stdout);
+  curl_easy_setopt(this, CURLOPT_HEADERFUNCTION, NULL);
+  curl_easy_setopt(this, CURLOPT_HEADERDATA, NULL);
+  curl_easy_setopt(this, CURLOPT_TIMEOUT, 0L);
+  curl_easy_setopt(this, CURLOPT_SSL_OPTIONS, curl_policy.ssl_options);
+  curl_easy_setopt(this, CURLOPT_ACCEPT_ENCODING, NULL);
+}
+
+
+/* keep the connection of the warm handles open with a HEAD of the base url,
+ * then give them back to the pool */
+static void curl_pool_ping (LinkedListHead *idle, time_t interval) {
+  curl_char *url = NULL;
+  if (idle && curl_pool.options && curl_breaker.state == CURL_BREAKER_CLOSED) {
+    curl_url_get(curl_pool.options->baseurl, CURLUPART_URL, &url, 0);
+  }
+
+  while (idle) {
+    struct CurlHandle *handle = (struct CurlHandle *) idle;
+    idle = idle->next;
+
+    if (url) {
+      curl_easy_reset_soft(handle->curl);
+      /* still pointing to the exception of the thread that used it last */
+      curl_easy_setopt(handle->curl, CURLOPT_ERRORBUFFER, NULL);
+      curl_easy_setopt(handle->curl, CURLOPT_URL, url);
+      curl_easy_setopt(handle->curl, CURLOPT_NOBODY, 1L);
+      curl_easy_setopt(handle->curl, CURLOPT_TIMEOUT, (long) interval);
+      if (curl_easy_perform(handle->curl) == CURLE_OK) {
+        curl_stats.pool_pings++;
+      }
+      handle->last_used = curl_pool_now();
+    }
+    Stack_push(&curl_pool.stack, (LinkedListHead *) handle);
+  }
+
+  curl_free(url);
+}
+
+
+static void *curl_pool_reaper (void *arg) {
+  time_t interval = curl_pool.idle_timeout / 2;
+  if (interval < 1) {
+    interval = 1;
+  }
+
+  synchronized (mutex, &curl_pool.reaper_lock, lock) {
+    while (!curl_pool.stopping) {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += interval;
+      pthread_cond_timedwait(&curl_pool.reaper_cond, &curl_pool.reaper_lock, &ts);
+      if (curl_pool.stopping) {
+        break;
+      }
+      LinkedListHead *idle = curl_pool_reap(curl_pool_now(), interval);
+      /* not under the lock, which only guards the sleep */
+      pthread_mutex_unlock(&curl_pool.reaper_lock);
+      curl_pool_ping(idle, interval);
+      pthread_mutex_lock(&curl_pool.reaper_lock);
+    }
+  }
+
+  return NULL;
+}
+
+
+/* The reaper is started on first use rather than in curl_global_init_common,
+ * because fuse daemonizes after the options are parsed and threads do not
+ * survive the fork. */
+static void curl_pool_start_reaper (void) {
+  if (curl_pool.idle_timeout <= 0) {
+    return;
+  }
+  curl_pool.reaper_started = pthread_create(&curl_pool.reaper, NULL, curl_pool_reaper, NULL) == 0;
+}
+
+
+static void curl_share_lock (CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr) {
+  while (pthread_mutex_lock(&curl_policy.share_lock[data]));
+}
+
+
+static void curl_share_unlock (CURL *handle, curl_lock_data data, void *userptr) {
+  pthread_mutex_unlock(&curl_policy.share_lock[data]);
+}
+
+
+static int curl_policy_share_init (void) {
+  curl_policy.share = curl_share_init();
+  if unlikely (curl_policy.share == NULL) {
+    return 1;
+  }
+
+  for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+    pthread_mutex_init(&curl_policy.share_lock[i], NULL);
+  }
+  curl_share_setopt(curl_policy.share, CURLSHOPT_LOCKFUNC, curl_share_lock);
+  curl_share_setopt(curl_policy.share, CURLSHOPT_UNLOCKFUNC, curl_share_unlock);
+  return 0;
+}
+
+
+/* fuse changes to / once daemonized, keep paths used later absolute */
+static char *curl_absolute_path (const char *path) {
+  if (path[0] == '/') {
+    return strdup(path);
+  }
+
+  char *cwd = getcwd(NULL, 0);
+  if unlikely (cwd == NULL) {
+    return NULL;
+  }
+  size_t size = strlen(cwd) + strlen(path) + 2;
+  char *abs_path = malloc(size);
+  if likely (abs_path) {
+    snprintf(abs_path, size, "%s/%s", cwd, path);
+  }
+  free(cwd);
+  return abs_path;
+}
+
+
+#if CURL_AT_LEAST_VERSION(8, 12, 0)
+#define CURL_SSLS_MAGIC "NETWORKFS-SSLS1\n"
+#define CURL_SSLS_FIELD_MAX 65536
+
+
+static bool curl_ssls_write_field (FILE *file, const void *data, size_t len) {
+  uint32_t len32 = len;
+  return fwrite(&len32, sizeof(len32), 1, file) == 1 &&
+         (len == 0 || fwrite(data, len, 1, file) == 1);
+}
+
+
+/* returns a malloc'd buffer, NUL terminated for convenience */
+static unsigned char *curl_ssls_read_field (FILE *file, size_t *lenp) {
+  uint32_t len32;
+  if (fread(&len32, sizeof(len32), 1, file) != 1 || len32 > CURL_SSLS_FIELD_MAX) {
+    return NULL;
+  }
+
+  unsigned char *data = malloc(len32 + 1);
+  if unlikely (data == NULL) {
+    return NULL;
+  }
+  if (len32 > 0 && fread(data, len32, 1, file) != 1) {
+    free(data);
+    return NULL;
+  }
+  data[len32] = '\0';
+  *lenp = len32;
+  return data;
+}
+
+
+static CURLcode curl_ssls_save_one (
+    CURL *handle, void *userptr, const char *session_key,
+    const unsigned char *shmac, size_t shmac_len,
+    const unsigned char *sdata, size_t sdata_len,
+    curl_off_t valid_until, int ietf_tls_id, const char *alpn, size_t earlydata_max) {
+  FILE *file = (FILE *) userptr;
+  int64_t expire = valid_until;
+
+  bool ok = curl_ssls_write_field(file, session_key, session_key ? strlen(session_key) : 0) &&
+            curl_ssls_write_field(file, shmac, shmac_len) &&
+            curl_ssls_write_field(file, sdata, sdata_len) &&
+            fwrite(&expire, sizeof(expire), 1, file) == 1;
+  return ok ? CURLE_OK : CURLE_WRITE_ERROR;
+}
+
+
+static void curl_ssls_save (const char *path) {
+  size_t path_len = strlen(path);
+  char tmp_path[path_len + 5];
+  memcpy(tmp_path, path, path_len);
+  memcpy(tmp_path + path_len, ".tmp", 5);
+
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if unlikely (fd < 0) {
+    perror("Error saving TLS sessions");
+    return;
+  }
+  FILE *file = fdopen(fd, "wb");
+  if unlikely (file == NULL) {
+    close(fd);
+    unlink(tmp_path);
+    return;
+  }
+
+  bool ok = fputs(CURL_SSLS_MAGIC, file) >= 0;
+  CURL *curl = curl_easy_init();
+  if likely (ok && curl) {
+    curl_easy_setopt(curl, CURLOPT_SHARE, curl_policy.share);
+    ok = curl_easy_ssls_export(curl, curl_ssls_save_one, file) == CURLE_OK;
+  }
+  curl_easy_cleanup(curl);
+
+  if (fclose(file) != 0 || !ok || rename(tmp_path, path) != 0) {
+    fputs("Error saving TLS sessions\n", stderr);
+    unlink(tmp_path);
+  }
+}
+
+
+static CURLcode curl_ssls_noop (
+    CURL *handle, void *userptr, const char *session_key,
+    const unsigned char *shmac, size_t shmac_len,
+    const unsigned char *sdata, size_t sdata_len,
+    curl_off_t valid_until, int ietf_tls_id, const char *alpn, size_t earlydata_max) {
+  return CURLE_OK;
+}
+
+
+/* session export is an optional libcurl build feature */
+static bool curl_ssls_supported (void) {
+  CURL *curl = curl_easy_init();
+  if unlikely (curl == NULL) {
+    return false;
+  }
+  curl_easy_setopt(curl, CURLOPT_SHARE, curl_policy.share);
+  bool res = curl_easy_ssls_export(curl, curl_ssls_noop, NULL) != CURLE_NOT_BUILT_IN;
+  curl_easy_cleanup(curl);
+  return res;
+}
+
+
+static void curl_ssls_load (const char *path) {
+  int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+
+  /* session tickets are as good as credentials for resuming, ignore a file
+   * anybody else could have read or planted */
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_uid != geteuid() || (st.st_mode & 077)) {
+    fprintf(stderr, "Ignoring TLS session cache %s: not a private file\n", path);
+    close(fd);
+    return;
+  }
+
+  FILE *file = fdopen(fd, "rb");
+  if unlikely (file == NULL) {
+    close(fd);
+    return;
+  }
+
+  char magic[sizeof(CURL_SSLS_MAGIC) - 1];
+  CURL *curl = curl_easy_init();
+  if likely (curl && fread(magic, sizeof(magic), 1, file) == 1 &&
+             memcmp(magic, CURL_SSLS_MAGIC, sizeof(magic)) == 0) {
+    curl_easy_setopt(curl, CURLOPT_SHARE, curl_policy.share);
+
+    time_t now = time(NULL);
+    while (true) {
+      size_t key_len, shmac_len, sdata_len;
+      int64_t expire;
+      unsigned char *key = curl_ssls_read_field(file, &key_len);
+      unsigned char *shmac = key ? curl_ssls_read_field(file, &shmac_len) : NULL;
+      unsigned char *sdata = shmac ? curl_ssls_read_field(file, &sdata_len) : NULL;
+      bool ok = sdata && fread(&expire, sizeof(expire), 1, file) == 1;
+
+      if (ok && (expire == 0 || expire > now)) {
+        curl_easy_ssls_import(
+          curl, key_len ? (const char *) key : NULL, shmac, shmac_len, sdata, sdata_len);
+      }
+      free(key);
+      free(shmac);
+      free(sdata);
+      if (!ok) {
+        break;
+      }
+    }
+  }
+  curl_easy_cleanup(curl);
+  fclose(file);
+}
+#endif
+
+
+int curl_global_init_common (const struct networkfs_opts *options) {
+  int res = curl_global_init(CURL_GLOBAL_ALL);
+  if unlikely (res) {
+    return res;
+  }
+
+  if likely (options) {
+    curl_pool.max = options->pool_max;
+    curl_pool.min = options->pool_min;
+    curl_pool.idle_timeout = options->pool_idle_timeout;
+    curl_pool.options = options;
+
+    curl_policy.hedge = options->hedge;
+    curl_policy.hedge_delay = options->hedge_delay;
+    curl_policy.retries = options->retries;
+    curl_policy.retry_delay = options->retry_delay;
+    curl_policy.timeout[CURL_CLASS_META] = options->meta_timeout;
+    curl_policy.timeout[CURL_CLASS_DATA] = options->data_timeout;
+
+    if (options->tls_session_cache) {
+      /* fuse changes to / once daemonized */
+      curl_policy.tls_session_cache = curl_absolute_path(options->tls_session_cache);
+    }
+    curl_policy.tcp_fastopen = options->tcp_fastopen;
+    if (curl_policy.tcp_fastopen && options->use_ssl != CURLUSESSL_NONE) {
+      /* libcurl 8.14 dereferences NULL when fast open meets TLS */
+      unsigned int version = curl_version_info(CURLVERSION_NOW)->version_num;
+      if (version >= CURL_VERSION_BITS(8, 14, 0) && version < CURL_VERSION_BITS(8, 15, 0)) {
+        fputs("tcp_fastopen: broken with TLS in this libcurl, ignored\n", stderr);
+        curl_policy.tcp_fastopen = false;
+      }
+    }
+    curl_policy.early_data = options->early_data;
+    curl_policy.cookies = options->cookies;
+    curl_policy.expect_threshold = options->expect_threshold;
+    curl_policy.accept_encoding[CURL_CLASS_META] = options->compress ? "" : NULL;
+    curl_policy.accept_encoding[CURL_CLASS_DATA] = options->compress_data ? "" : NULL;
+
+    curl_breaker.threshold = options->breaker_threshold;
+    curl_breaker.probe = max(options->breaker_probe, 1L);
+    curl_breaker.options = options;
+  }
+
+  res = curl_policy_share_init();
+  if unlikely (res) {
+    return res;
+  }
+  /* resume TLS sessions across connections of all handles */
+  curl_share_setopt(curl_policy.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  if (curl_policy.hedge) {
+    curl_share_setopt(curl_policy.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+  }
+  if (curl_policy.cookies) {
+    curl_share_setopt(curl_policy.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE);
+  }
+
+  if (curl_policy.tls_session_cache) {
+  #if CURL_AT_LEAST_VERSION(8, 12, 0)
+    if (curl_ssls_supported()) {
+      curl_ssls_load(curl_policy.tls_session_cache);
+    } else {
+      fputs("tls_session_cache: libcurl built without SSL session export, ignored\n", stderr);
+      free(curl_policy.tls_session_cache);
+      curl_policy.tls_session_cache = NULL;
+    }
+  #else
+    fputs("tls_session_cache needs libcurl 8.12.0 or later, ignored\n", stderr);
+    free(curl_policy.tls_session_cache);
+    curl_policy.tls_session_cache = NULL;
+  #endif
+  }
+#if !CURL_AT_LEAST_VERSION(8, 11, 0)
+  if (curl_policy.early_data) {
+    fputs("early_data needs libcurl 8.11.0 or later, ignored\n", stderr);
+    curl_policy.early_data = false;
+  }
+#endif
+  return 0;
+}
+
+
+void curl_global_cleanup_common (void) {
+  synchronized (mutex, &curl_pool.reaper_lock, lock) {
+    curl_pool.stopping = true;
+    pthread_cond_signal(&curl_pool.reaper_cond);
+  }
+  if (curl_pool.reaper_started) {
+    pthread_join(curl_pool.reaper, NULL);
+  }
+
+  synchronized (mutex, &curl_breaker.lock, lock) {
+    curl_breaker.stopping = true;
+    pthread_cond_signal(&curl_breaker.cond);
+  }
+  if (curl_breaker.prober_started) {
+    pthread_join(curl_breaker.prober, NULL);
+  }
+
+  struct CurlHandle *cached = pthread_getspecific(curl_pool.cached);
+  if (cached) {
+    pthread_setspecific(curl_pool.cached, NULL);
+    curl_pool.ncached--;
+    curl_handle_free(cached);
+  }
+  for (LinkedListHead *node; (node = Stack_pop(&curl_pool.stack));) {
+    curl_handle_free((struct CurlHandle *) node);
+  }
+
+  if (curl_policy.share) {
+  #if CURL_AT_LEAST_VERSION(8, 12, 0)
+    if (curl_policy.tls_session_cache) {
+      curl_ssls_save(curl_policy.tls_session_cache);
+    }
+  #endif
+    curl_share_cleanup(curl_policy.share);
+    curl_policy.share = NULL;
+  }
+  free(curl_policy.tls_session_cache);
+  curl_policy.tls_session_cache = NULL;
+
+  curl_global_cleanup();
+}
+
+
+static void curl_multi_free (void *multi) {
+  curl_multi_cleanup(multi);
+}
 
 
 static void __attribute__((constructor)) curl_load (void) {
-  Stack_init(&curl_handler_stack);
+  Stack_init(&curl_pool.stack);
+  pthread_key_create(&curl_pool.cached, curl_pool_release_cached);
+  pthread_key_create(&curl_policy.multi, curl_multi_free);
 }
 
 
@@ -28,8 +698,8 @@ int CurlException_init (
     CURLcode code, enum CURLaction action, ...) {
   bool no_bt = false;
 
-  if (e->action == CURL_PERFORM) {
-    if (e->code == CURLE_HTTP_RETURNED_ERROR) {
+  if (action == CURL_PERFORM) {
+    if (code == CURLE_HTTP_RETURNED_ERROR || code == CURLE_CIRCUIT_OPEN) {
       no_bt = true;
     }
   }
@@ -90,6 +760,10 @@ static int Exception_fputs_curl (const BaseException *e_, FILE *stream) {
       break;
   }
 
+  if (e->code == CURLE_CIRCUIT_OPEN) {
+    return res + fprintf(stream, "Server unreachable, not trying\n");
+  }
+
   res += fprintf(
     stream, "%s\n",
     e->error_buf[0] == '\0' ? curl_easy_strerror(e->code) : e->error_buf
@@ -257,19 +931,38 @@ VTABLE_INIT(Exception, CurlUrlException) = {
 };
 
 
+/* count the 401 round trips, they should be gone once authenticated */
+static inline void curl_auth_account (CURL *curl) {
+  long avail = 0;
+  if unlikely (curl_easy_getinfo(curl, CURLINFO_HTTPAUTH_AVAIL, &avail) == CURLE_OK && avail) {
+    curl_stats.auth_challenges++;
+  }
+}
+
+
 CURL *curl_easy_init_common (
     CURLU *url, const char *path, const struct networkfs_opts *options) {
-  CURL *this;
+  CURL *this = NULL;
+  struct CurlHandle *handle = curl_handle_get();
 
   try {
-    LinkedList *node = (LinkedList *) Stack_pop(&curl_handler_stack);
-    if (node) {
-      this = node->value;
-      free(node);
-      curl_easy_reset(this);
+    if (handle) {
+      this = handle->curl;
+      curl_easy_reset_soft(this);
     } else {
-      this = curl_easy_init();
+      throwable handle = malloc_et(struct CurlHandle);
+      handle->next = NULL;
+      handle->warm = false;
+      this = handle->curl = curl_easy_init();
       condition_throw(this) CurlException(0, CURL_INIT);
+      curl_easy_setopt(this, CURLOPT_PRIVATE, handle);
+      if (curl_policy.share) {
+        curl_easy_setopt(this, CURLOPT_SHARE, curl_policy.share);
+      }
+      if (curl_policy.cookies) {
+        /* enable the cookie engine without reading any file */
+        curl_easy_setopt(this, CURLOPT_COOKIEFILE, "");
+      }
     }
 
     ((CurlException *) &ex)->error_buf[0] = '\0';
@@ -295,6 +988,9 @@ CURL *curl_easy_init_common (
     if likely (options) {
       curl_easy_setopt_or_die(this, CURLOPT_USERNAME, options->username);
       curl_easy_setopt_or_die(this, CURLOPT_PASSWORD, options->password);
+      if (options->httpauth) {
+        curl_easy_setopt_or_die(this, CURLOPT_HTTPAUTH, options->httpauth);
+      }
 
       if (options->interface) {
         curl_easy_setopt_or_die(this, CURLOPT_INTERFACE, options->interface);
@@ -358,8 +1054,23 @@ CURL *curl_easy_init_common (
     curl_easy_setopt(this, CURLOPT_FAILONERROR, 1L);
     curl_easy_setopt(this, CURLOPT_FOLLOWLOCATION, 1L);
     curl_easy_setopt(this, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
+
+    /* keep pooled connections alive as long as the pool keeps the handle */
+    curl_easy_setopt(this, CURLOPT_TCP_KEEPALIVE, 1L);
+    if (curl_policy.tcp_fastopen) {
+      curl_easy_setopt(this, CURLOPT_TCP_FASTOPEN, 1L);
+    }
+    if (curl_policy.ssl_options) {
+      curl_easy_setopt(this, CURLOPT_SSL_OPTIONS, curl_policy.ssl_options);
+    }
+  #if CURL_AT_LEAST_VERSION(7, 65, 0)
+    if (curl_pool.idle_timeout > 0) {
+      /* the reaper keeps warm connections alive, whatever their age */
+      curl_easy_setopt(this, CURLOPT_MAXAGE_CONN, handle->warm ? LONG_MAX : curl_pool.idle_timeout);
+    }
+  #endif
   } onerror (e) {
-    curl_easy_cleanup(this);
+    curl_handle_free(handle);
     this = NULL;
   }
 
@@ -370,13 +1081,635 @@ CURL *curl_easy_init_common (
 void curl_easy_cleanup_common (CURL *this) {
   PROTECT_RETURN(this);
 
-  auto node = malloc_t(LinkedList);
-  if unlikely (node == NULL) {
-    fprintf(stderr, "curl_easy_cleanup_common malloc failed\n");
+  struct CurlHandle *handle = NULL;
+  curl_easy_getinfo(this, CURLINFO_PRIVATE, (char **) &handle);
+  if unlikely (handle == NULL || handle->curl != this) {
     curl_easy_cleanup(this);
     return;
   }
 
-  node->value = this;
-  Stack_push(&curl_handler_stack, (LinkedListHead *) node);
+  pthread_once(&curl_pool.reaper_once, curl_pool_start_reaper);
+  curl_handle_put(handle);
+}
+
+
+/* errors telling that the server could not be reached at all, as opposed to
+ * the server answering with an error */
+static bool curl_breaker_failure (CURLcode code) {
+  switch (code) {
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_GOT_NOTHING:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+      return true;
+    default:
+      return false;
+  }
+}
+
+
+/* a slow or broken transfer of a large body says little about the server,
+ * only count it if the connection never came up or the request was small */
+static bool curl_breaker_counts (CURL *curl, CURLcode code, enum CurlClass klass) {
+  switch (code) {
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_SSL_CONNECT_ERROR:
+      return true;
+    default:
+      break;
+  }
+
+  if likely (!curl_breaker_failure(code)) {
+    return false;
+  }
+  if (klass == CURL_CLASS_META) {
+    return true;
+  }
+
+  curl_off_t connected = 0;
+  curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connected);
+  return connected == 0;
+}
+
+
+static void *curl_breaker_prober (void *arg) {
+  while (true) {
+    bool stopping = false;
+    synchronized (mutex, &curl_breaker.lock, lock) {
+      while (!curl_breaker.stopping && curl_breaker.state == CURL_BREAKER_CLOSED) {
+        pthread_cond_wait(&curl_breaker.cond, &curl_breaker.lock);
+      }
+      if (!curl_breaker.stopping) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += curl_breaker.probe;
+        pthread_cond_timedwait(&curl_breaker.cond, &curl_breaker.lock, &ts);
+      }
+      stopping = curl_breaker.stopping;
+      if (!stopping) {
+        curl_breaker.state = CURL_BREAKER_HALF_OPEN;
+      }
+    }
+    if (stopping) {
+      break;
+    }
+
+    CURLcode res = CURLE_FAILED_INIT;
+    CURL *curl = curl_easy_init_common(curl_breaker.options->baseurl, NULL, curl_breaker.options);
+    if likely (curl) {
+      curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+      curl_easy_setopt(curl, CURLOPT_TIMEOUT, curl_breaker.probe);
+      res = curl_easy_perform(curl);
+      curl_easy_cleanup_common(curl);
+    } else if (Exception_has(&ex)) {
+      Exception_destory(&ex);
+    }
+
+    synchronized (mutex, &curl_breaker.lock, lock) {
+      /* any answer, even an error status, means the server is back */
+      if (curl_breaker_failure(res) || res == CURLE_FAILED_INIT) {
+        curl_breaker.state = CURL_BREAKER_OPEN;
+      } else {
+        curl_breaker.state = CURL_BREAKER_CLOSED;
+        curl_breaker.failures = 0;
+        fputs("Server reachable again\n", stderr);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+
+static inline bool curl_breaker_allow (void) {
+  if likely (curl_breaker.state == CURL_BREAKER_CLOSED) {
+    return true;
+  }
+  curl_stats.breaker_rejects++;
+  return false;
+}
+
+
+static void curl_breaker_feed (CURL *curl, CURLcode code, enum CurlClass klass) {
+  if (curl_breaker.threshold <= 0) {
+    return;
+  }
+
+  if likely (!curl_breaker_counts(curl, code, klass)) {
+    if unlikely (curl_breaker.failures) {
+      synchronized (mutex, &curl_breaker.lock, lock) {
+        if (curl_breaker.state == CURL_BREAKER_CLOSED) {
+          curl_breaker.failures = 0;
+        }
+      }
+    }
+    return;
+  }
+
+  synchronized (mutex, &curl_breaker.lock, lock) {
+    if (curl_breaker.state != CURL_BREAKER_CLOSED ||
+        ++curl_breaker.failures < curl_breaker.threshold) {
+      break;
+    }
+
+    curl_breaker.state = CURL_BREAKER_OPEN;
+    curl_stats.breaker_trips++;
+    fprintf(stderr, "Server unreachable: %s, failing fast until it answers\n", curl_easy_strerror(code));
+    /* started on the first trip, see curl_pool_start_reaper */
+    if (!curl_breaker.prober_started && curl_breaker.options) {
+      curl_breaker.prober_started =
+        pthread_create(&curl_breaker.prober, NULL, curl_breaker_prober, NULL) == 0;
+    }
+    if (!curl_breaker.prober_started) {
+      /* nobody to close it again, keep working the slow way */
+      curl_breaker.state = CURL_BREAKER_CLOSED;
+      curl_breaker.failures = 0;
+    }
+    pthread_cond_signal(&curl_breaker.cond);
+  }
+}
+
+
+static inline void curl_apply_class (CURL *curl, enum CurlClass klass) {
+  if (curl_policy.timeout[klass]) {
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, curl_policy.timeout[klass]);
+  }
+  /* decoded on the fly, the write callback sees plain data */
+  if (curl_policy.accept_encoding[klass]) {
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, curl_policy.accept_encoding[klass]);
+  }
+}
+
+
+/* header sink of an upload sent with Expect */
+struct CurlExpect {
+  data_callback_t header;
+  void *header_data;
+};
+
+
+static size_t curl_expect_callback (char *ptr, size_t size, size_t nmemb, void *data) {
+  struct CurlExpect *expect = (struct CurlExpect *) data;
+
+  /* "HTTP/1.1 100 Continue", "HTTP/2 100" */
+  if (nmemb > 5 && memcmp(ptr, "HTTP/", 5) == 0) {
+    const char *code = memchr(ptr, ' ', nmemb);
+    if (code && (size_t) (code - ptr) + 4 <= nmemb && memcmp(code + 1, "100", 3) == 0) {
+      curl_stats.expect_continued++;
+    }
+  }
+
+  if (expect->header == NULL) {
+    return size * nmemb;
+  }
+  return expect->header(ptr, size, nmemb, expect->header_data);
+}
+
+
+/* Upload policy of a request body read by callback. Small bodies go right
+ * away, a server that does not answer Expect would stall them for a second.
+ * Large ones ask first if configured, so a rejected upload is not sent in
+ * vain. Waits are counted as expect_sent - expect_continued. The response
+ * headers go to `header` unless NULL, it must not be set by the caller. */
+struct curl_slist *curl_easy_expect_common (
+    CURL *curl, Arena *arena, struct curl_slist *list, curl_off_t size,
+    data_callback_t header, void *header_data) {
+  if (curl_policy.expect_threshold <= 0 || size < curl_policy.expect_threshold) {
+    if (header) {
+      curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header);
+      curl_easy_setopt(curl, CURLOPT_HEADERDATA, header_data);
+    }
+    return curl_slist_append_arena(arena, list, CURL_HEADER_NO_EXPECT);
+  }
+
+  struct CurlExpect *expect = Arena_alloc(arena, sizeof(struct CurlExpect));
+  should (expect) otherwise {
+    return list;
+  }
+  expect->header = header;
+  expect->header_data = header_data;
+  curl_stats.expect_sent++;
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curl_expect_callback);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, expect);
+  return curl_slist_append_arena(arena, list, "Expect: 100-continue");
+}
+
+
+/* A 401 while sending a session cookie means the session expired or was
+ * revoked. Drop the jar, so the retry authenticates with the password and
+ * gets a new session. */
+static bool curl_cookie_expired (CURL *curl, CURLcode code) {
+  if likely (!curl_policy.cookies || code != CURLE_HTTP_RETURNED_ERROR) {
+    return false;
+  }
+
+  long response_code = 0;
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+  if (response_code != 401) {
+    return false;
+  }
+
+  struct curl_slist *cookies = NULL;
+  curl_easy_getinfo(curl, CURLINFO_COOKIELIST, &cookies);
+  if (cookies == NULL) {
+    return false;
+  }
+  curl_slist_free_all(cookies);
+
+  curl_easy_setopt(curl, CURLOPT_COOKIELIST, "ALL");
+  curl_stats.cookie_resets++;
+  return true;
+}
+
+
+CURLcode curl_easy_perform_common (CURL *curl, enum CurlClass klass) {
+  if unlikely (!curl_breaker_allow()) {
+    return CURLE_CIRCUIT_OPEN;
+  }
+
+  curl_apply_class(curl, klass);
+  CURLcode res = curl_easy_perform(curl);
+  curl_breaker_feed(curl, res, klass);
+  curl_auth_account(curl);
+
+  if unlikely (curl_cookie_expired(curl, res)) {
+    /* an upload body cannot be rewound, only retry if nothing was sent */
+    curl_off_t uploaded = 0;
+    curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &uploaded);
+    if (uploaded == 0) {
+      res = curl_easy_perform(curl);
+      curl_breaker_feed(curl, res, klass);
+      curl_auth_account(curl);
+    }
+  }
+  return res;
+}
+
+
+/* Sinks of an idempotent request. The first attempt to answer wins and is
+ * forwarded to the caller, the others are cancelled. */
+struct CurlSink {
+  data_callback_t write;
+  void *write_data;
+  data_callback_t header;
+  void *header_data;
+  CURL *winner;
+  /* body passed to the caller, a retry is no longer possible */
+  bool delivered;
+  /* body bytes after decoding */
+  curl_off_t decoded;
+};
+
+struct CurlAttempt {
+  struct CurlSink *sink;
+  CURL *curl;
+  /* of the response being received, 0 before its status line */
+  long status;
+};
+
+
+/* only a success or a redirect answers, an interim response, an
+ * authentication round or an error may still lose to the other attempt */
+static inline bool curl_attempt_claim (struct CurlAttempt *attempt) {
+  if (attempt->sink->winner == NULL && attempt->status >= 200 && attempt->status < 400) {
+    attempt->sink->winner = attempt->curl;
+  }
+  return attempt->sink->winner == attempt->curl;
+}
+
+
+static size_t curl_attempt_write (char *ptr, size_t size, size_t nmemb, void *data) {
+  struct CurlAttempt *attempt = (struct CurlAttempt *) data;
+  if unlikely (!curl_attempt_claim(attempt)) {
+    /* cancelled, or the body of a response that does not count */
+    return attempt->sink->winner == NULL ? size * nmemb : 0;
+  }
+
+  attempt->sink->delivered = true;
+  attempt->sink->decoded += size * nmemb;
+  if (attempt->sink->write == NULL) {
+    return size * nmemb;
+  }
+  return attempt->sink->write(ptr, size, nmemb, attempt->sink->write_data);
+}
+
+
+static size_t curl_attempt_header (char *ptr, size_t size, size_t nmemb, void *data) {
+  struct CurlAttempt *attempt = (struct CurlAttempt *) data;
+  if (size * nmemb > 5 && strncmp(ptr, "HTTP/", 5) == 0) {
+    const char *code = memchr(ptr, ' ', size * nmemb);
+    attempt->status = code ? strtol(code + 1, NULL, 10) : 0;
+  }
+  if unlikely (!curl_attempt_claim(attempt)) {
+    return attempt->sink->winner == NULL ? size * nmemb : 0;
+  }
+
+  if (attempt->sink->header == NULL) {
+    return size * nmemb;
+  }
+  return attempt->sink->header(ptr, size, nmemb, attempt->sink->header_data);
+}
+
+
+static void curl_attempt_bind (struct CurlAttempt *attempt, CURL *curl, struct CurlSink *sink) {
+  attempt->sink = sink;
+  attempt->curl = curl;
+  attempt->status = 0;
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_attempt_write);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, attempt);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curl_attempt_header);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, attempt);
+}
+
+
+static void curl_latency_record (enum CurlClass klass, curl_off_t us) {
+  struct CurlLatency *latency = &curl_latency[klass];
+
+  int i = us > 1 ? 63 - __builtin_clzll(us) : 0;
+  if (i >= CURL_LATENCY_BUCKETS) {
+    i = CURL_LATENCY_BUCKETS - 1;
+  }
+  latency->bucket[i]++;
+
+  /* exponential decay, so the percentile follows the current conditions */
+  if unlikely (++latency->count == CURL_LATENCY_DECAY) {
+    for (int j = 0; j < CURL_LATENCY_BUCKETS; j++) {
+      latency->bucket[j] /= 2;
+    }
+    latency->count -= CURL_LATENCY_DECAY / 2;
+  }
+}
+
+
+/* running p95 in milliseconds, -1 if not enough samples yet */
+static long curl_latency_p95 (enum CurlClass klass) {
+  struct CurlLatency *latency = &curl_latency[klass];
+
+  unsigned long buckets[CURL_LATENCY_BUCKETS];
+  unsigned long total = 0;
+  for (int i = 0; i < CURL_LATENCY_BUCKETS; i++) {
+    buckets[i] = latency->bucket[i];
+    total += buckets[i];
+  }
+  if (total < CURL_LATENCY_MIN_SAMPLES) {
+    return -1;
+  }
+
+  unsigned long cumulative = 0;
+  for (int i = 0; i < CURL_LATENCY_BUCKETS; i++) {
+    cumulative += buckets[i];
+    if (cumulative * 100 >= total * 95) {
+      return ((2ULL << i) + 999) / 1000;
+    }
+  }
+  return -1;
+}
+
+
+static inline long curl_now_ms (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static bool curl_retryable (CURL *curl, CURLcode code) {
+  switch (code) {
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_PARTIAL_FILE:
+      return true;
+    case CURLE_HTTP_RETURNED_ERROR: {
+      long response_code = 0;
+      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+      return response_code == 500 || response_code == 502 ||
+             response_code == 503 || response_code == 504;
+    }
+    default:
+      return false;
+  }
+}
+
+
+static void curl_backoff (long attempt) {
+  long delay = curl_policy.retry_delay << min(attempt, 16L);
+  if (delay > CURL_RETRY_DELAY_MAX) {
+    delay = CURL_RETRY_DELAY_MAX;
+  }
+  /* jitter, so retrying threads do not arrive in lockstep */
+  delay = delay / 2 + random() % (delay / 2 + 1);
+
+  struct timespec ts = {.tv_sec = delay / 1000, .tv_nsec = delay % 1000 * 1000000};
+  while (nanosleep(&ts, &ts));
+}
+
+
+static CURL *curl_handle_dup (CURL *curl) {
+  struct CurlHandle *handle = malloc_t(struct CurlHandle);
+  if unlikely (handle == NULL) {
+    return NULL;
+  }
+
+  handle->next = NULL;
+  handle->curl = curl_easy_duphandle(curl);
+  if unlikely (handle->curl == NULL) {
+    free(handle);
+    return NULL;
+  }
+  curl_easy_setopt(handle->curl, CURLOPT_PRIVATE, handle);
+  return handle->curl;
+}
+
+
+static CURLM *curl_multi_get (void) {
+  CURLM *multi = pthread_getspecific(curl_policy.multi);
+  if unlikely (multi == NULL) {
+    multi = curl_multi_init();
+    if (multi && pthread_setspecific(curl_policy.multi, multi)) {
+      curl_multi_cleanup(multi);
+      multi = NULL;
+    }
+  }
+  return multi;
+}
+
+
+/* Run the request, and if it did not answer within delay_ms, race a
+ * duplicate on another connection against it. */
+static CURLcode curl_perform_hedged (CURL **curlp, struct CurlSink *sink, long delay_ms) {
+  struct CurlAttempt attempts[2];
+  CURL *curls[2] = {*curlp, NULL};
+  bool active[2] = {false, false};
+
+  CURLM *multi = curl_multi_get();
+  curl_attempt_bind(&attempts[0], curls[0], sink);
+  if unlikely (multi == NULL || curl_multi_add_handle(multi, curls[0]) != CURLM_OK) {
+    return curl_easy_perform(curls[0]);
+  }
+  active[0] = true;
+
+  CURLcode res = CURLE_OK;
+  long start = curl_now_ms();
+  bool hedged = false;
+  bool done = false;
+
+  while (!done) {
+    int running;
+    if unlikely (curl_multi_perform(multi, &running) != CURLM_OK) {
+      res = CURLE_FAILED_INIT;
+      break;
+    }
+
+    CURLMsg *msg;
+    int msgs_left;
+    while (!done && (msg = curl_multi_info_read(multi, &msgs_left))) {
+      if (msg->msg != CURLMSG_DONE) {
+        continue;
+      }
+
+      int i = msg->easy_handle == curls[0] ? 0 : 1;
+      CURLcode result = msg->data.result;
+      curl_multi_remove_handle(multi, curls[i]);
+      active[i] = false;
+
+      if (sink->winner == curls[i]) {
+        res = result;
+        done = true;
+      } else if (sink->winner == NULL) {
+        /* failed before answering, wait for the other one if any */
+        res = result;
+        if (result == CURLE_OK || !active[1 - i]) {
+          sink->winner = curls[i];
+          done = true;
+        }
+      }
+    }
+    if (done) {
+      break;
+    }
+
+    /* cancel the loser early */
+    if (sink->winner) {
+      for (int i = 0; i < 2; i++) {
+        if (active[i] && curls[i] != sink->winner) {
+          curl_multi_remove_handle(multi, curls[i]);
+          active[i] = false;
+        }
+      }
+    }
+
+    long elapsed = curl_now_ms() - start;
+    if (!hedged && sink->winner == NULL && elapsed >= delay_ms) {
+      hedged = true;
+      curls[1] = curl_handle_dup(curls[0]);
+      if (curls[1]) {
+        curl_attempt_bind(&attempts[1], curls[1], sink);
+        if likely (curl_multi_add_handle(multi, curls[1]) == CURLM_OK) {
+          active[1] = true;
+          curl_stats.hedges_sent++;
+        }
+      }
+    }
+
+    long timeout = hedged ? 1000 : delay_ms - elapsed;
+  #if CURL_AT_LEAST_VERSION(7, 66, 0)
+    curl_multi_poll(multi, NULL, 0, timeout, NULL);
+  #else
+    curl_multi_wait(multi, NULL, 0, timeout, NULL);
+  #endif
+  }
+
+  for (int i = 0; i < 2; i++) {
+    if (active[i]) {
+      curl_multi_remove_handle(multi, curls[i]);
+    }
+  }
+
+  if (curls[1]) {
+    if (sink->winner == curls[1]) {
+      curl_stats.hedges_won++;
+      *curlp = curls[1];
+      curl_easy_cleanup_common(curls[0]);
+    } else {
+      curl_easy_cleanup_common(curls[1]);
+    }
+  }
+
+  return res;
+}
+
+
+CURLcode curl_easy_perform_idempotent (
+    CURL **curlp, enum CurlClass klass,
+    data_callback_t write, void *write_data, data_callback_t header, void *header_data) {
+  struct CurlSink sink = {
+    .write = write,
+    .write_data = write_data,
+    .header = header,
+    .header_data = header_data,
+  };
+
+  bool cookie_retried = false;
+
+  curl_apply_class(*curlp, klass);
+#if CURL_AT_LEAST_VERSION(8, 11, 0)
+  /* a replayed request does no harm here, so it may ride in the handshake */
+  if (curl_policy.early_data) {
+    curl_easy_setopt(*curlp, CURLOPT_SSL_OPTIONS, curl_policy.ssl_options | CURLSSLOPT_EARLYDATA);
+  }
+#endif
+
+  for (long attempt = 0;; attempt++) {
+    CURLcode res;
+
+    if unlikely (!curl_breaker_allow()) {
+      return CURLE_CIRCUIT_OPEN;
+    }
+
+    sink.winner = NULL;
+    sink.delivered = false;
+    sink.decoded = 0;
+
+    long delay = curl_policy.hedge ? curl_latency_p95(klass) : -1;
+    if (delay >= 0) {
+      res = curl_perform_hedged(curlp, &sink, max(delay, curl_policy.hedge_delay));
+    } else {
+      struct CurlAttempt single;
+      curl_attempt_bind(&single, *curlp, &sink);
+      res = curl_easy_perform(*curlp);
+    }
+    curl_breaker_feed(*curlp, res, klass);
+    curl_auth_account(*curlp);
+
+    if likely (res == CURLE_OK) {
+      curl_off_t ttfb;
+      if (curl_easy_getinfo(*curlp, CURLINFO_STARTTRANSFER_TIME_T, &ttfb) == CURLE_OK) {
+        curl_latency_record(klass, ttfb);
+      }
+      curl_off_t wire;
+      if (curl_easy_getinfo(*curlp, CURLINFO_SIZE_DOWNLOAD_T, &wire) == CURLE_OK) {
+        curl_stats.bytes_wire += wire;
+        curl_stats.bytes_decoded += sink.decoded;
+      }
+      return res;
+    }
+
+    if unlikely (!sink.delivered && !cookie_retried && curl_cookie_expired(*curlp, res)) {
+      /* not a failure of the server, retry at once and without counting */
+      cookie_retried = true;
+      attempt--;
+      continue;
+    }
+    if (sink.delivered || attempt >= curl_policy.retries || !curl_retryable(*curlp, res)) {
+      return res;
+    }
+    curl_stats.retries++;
+    curl_backoff(attempt);
+  }
 }
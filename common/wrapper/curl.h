@@ -1,11 +1,13 @@
 #ifndef NETWORKFS_CURL_H
 #define NETWORKFS_CURL_H
 
+#include <stdatomic.h>
 #include <string.h>
 
 #include <curl/curl.h>
 
 #include <grammar/try.h>
+#include <template/arena.h>
 #include <opts.h>
 
 
@@ -67,8 +69,12 @@ int CurlUrlException_init (
 #define curl_easy_getinfo_or_die(handle, info, ...) \
   curl_do_or_die(curl_easy_getinfo(handle, info, __VA_ARGS__), CURL_INFO, info)
 
-#define curl_easy_perform_or_die(handle) \
-  curl_do_or_die(curl_easy_perform(handle), CURL_PERFORM, handle)
+#define curl_easy_perform_or_die(handle, klass) \
+  curl_do_or_die(curl_easy_perform_common(handle, klass), CURL_PERFORM, handle)
+
+/* handle may be replaced by the duplicate which answered first */
+#define curl_easy_perform_idempotent_or_die(handle, klass, ...) \
+  curl_do_or_die(curl_easy_perform_idempotent(&(handle), klass, __VA_ARGS__), CURL_PERFORM, handle)
 
 inline char *curl_easy_unescape_e (CURL *curl, const char *url, int inlength, int *outlength) {
   char *ret = curl_easy_unescape(curl, url, inlength, outlength);
@@ -99,6 +105,28 @@ inline struct curl_slist *curl_slist_append_e (struct curl_slist *list, const ch
   return res;
 }
 
+/* Node and string live in the arena, such a list is released with the arena
+ * and must not be passed to curl_slist_free_all(). */
+inline struct curl_slist *curl_slist_append_arena (Arena *arena, struct curl_slist *list, const char *string) {
+  struct curl_slist *node = Arena_alloc(arena, sizeof(struct curl_slist));
+  char *data = node ? Arena_strdup(arena, string) : NULL;
+  should (data) otherwise {
+    return list;
+  }
+  node->data = data;
+  node->next = NULL;
+
+  if (list == NULL) {
+    return node;
+  }
+  struct curl_slist *tail = list;
+  while (tail->next) {
+    tail = tail->next;
+  }
+  tail->next = node;
+  return list;
+}
+
 #define curl_slist(...) GET_4TH_ARG( \
     arg0, ## __VA_ARGS__, curl_slist_append_e(__VA_ARGS__), curl_slist_append_e(NULL, __VA_ARGS__), NULL \
   )
@@ -178,8 +206,55 @@ inline CURLUcode curl_url_set_ssl (CURLU *h, int ssl_version) {
 
 typedef size_t (*data_callback_t) (char *, size_t, size_t, void *);
 
+/* request classes, with their own timeout and latency statistics */
+enum CurlClass {
+  CURL_CLASS_META,
+  CURL_CLASS_DATA,
+  CURL_CLASS_MAX,
+};
+
+/* suppresses the Expect: 100-continue libcurl adds to larger bodies */
+#define CURL_HEADER_NO_EXPECT "Expect:"
+
+/* returned instead of performing while the server is considered down,
+ * CURL_LAST is never returned by libcurl itself */
+#define CURLE_CIRCUIT_OPEN CURL_LAST
+
+#define CURL_STATS \
+  X(retries) \
+  X(pool_pings) \
+  X(breaker_trips) \
+  X(breaker_rejects) \
+  X(auth_challenges) \
+  X(cookie_resets) \
+  X(expect_sent) \
+  X(expect_continued) \
+  X(hedges_sent) \
+  X(hedges_won) \
+  X(bytes_wire) \
+  X(bytes_decoded) \
+
+struct CurlStats {
+#define X(s) atomic_ulong s;
+  CURL_STATS
+#undef X
+};
+
+extern struct CurlStats curl_stats;
+
+int curl_stats_snprint (char *buf, size_t size);
+
+int curl_global_init_common (const struct networkfs_opts *options);
+void curl_global_cleanup_common (void);
 CURL *curl_easy_init_common (CURLU *url, const char *path, const struct networkfs_opts *options);
 void curl_easy_cleanup_common (CURL *this);
+CURLcode curl_easy_perform_common (CURL *curl, enum CurlClass klass);
+struct curl_slist *curl_easy_expect_common (
+  CURL *curl, Arena *arena, struct curl_slist *list, curl_off_t size,
+  data_callback_t header, void *header_data);
+CURLcode curl_easy_perform_idempotent (
+    CURL **curlp, enum CurlClass klass,
+    data_callback_t write, void *write_data, data_callback_t header, void *header_data);
 
 
 #endif /* NETWORKFS_CURL_H */
@@ -42,6 +42,11 @@ struct _networkfs_opts {
   char *scheme;
   char *port;
 
+  bool anyauth;
+  bool basic;
+  bool digest;
+  bool ntlm;
+
   bool proxyanyauth;
   bool proxybasic;
   bool proxydigest;
@@ -68,11 +73,27 @@ static const struct fuse_opt option_spec[] = {
   NETWORKFS_OPT_KEY("user=%s",     username),
   NETWORKFS_OPT_KEY("username=%s", username),
   NETWORKFS_OPT_KEY("password=%s", password),
+  NETWORKFS_OPT_KEY("anyauth",     anyauth),
+  NETWORKFS_OPT_KEY("basic",       basic),
+  NETWORKFS_OPT_KEY("digest",      digest),
+  NETWORKFS_OPT_KEY("ntlm",        ntlm),
+  NETWORKFS_OPT_KEY("cookies",     cookies),
+  NETWORKFS_OPT_KEY("expect=%ld",  expect_threshold),
+  NETWORKFS_OPT("compress",        compress, true),
+  NETWORKFS_OPT("no_compress",     compress, false),
+  NETWORKFS_OPT_KEY("compress_data", compress_data),
 
   // -- main --
   NETWORKFS_OPT("hide_password",    hide_password, true),
   NETWORKFS_OPT("no_hide_password", hide_password, false),
   NETWORKFS_OPT_KEY("use_lock",     use_lock),
+  NETWORKFS_OPT_KEY("use_etag",     use_etag),
+  NETWORKFS_OPT_KEY("lock_timeout=%ld", lock_timeout),
+  NETWORKFS_OPT_KEY("lock_linger=%ld",  lock_linger),
+  NETWORKFS_OPT_KEY("defer_create=%ld", defer_create),
+  NETWORKFS_OPT_KEY("save_delay=%lf",   save_delay),
+  NETWORKFS_OPT_KEY("attr_delay=%lf",   attr_delay),
+  NETWORKFS_OPT_KEY("writeback_cache",  writeback_cache),
 
   // -- fuse --
   NETWORKFS_OPT_KEY("fmask=%o", fmask),
@@ -112,6 +133,24 @@ static const struct fuse_opt option_spec[] = {
   NETWORKFS_OPT_KEY("timeout=%ld",         timeout),
   NETWORKFS_OPT_KEY("connect_timeout=%ld", connect_timeout),
   NETWORKFS_OPT_KEY("initial_timeout=%ld", initial_timeout),
+  NETWORKFS_OPT_KEY("meta_timeout=%ld",    meta_timeout),
+  NETWORKFS_OPT_KEY("data_timeout=%ld",    data_timeout),
+
+  NETWORKFS_OPT_KEY("pool_max=%ld",          pool_max),
+  NETWORKFS_OPT_KEY("pool_min=%ld",          pool_min),
+  NETWORKFS_OPT_KEY("pool_idle_timeout=%ld", pool_idle_timeout),
+
+  NETWORKFS_OPT_KEY("hedge",             hedge),
+  NETWORKFS_OPT_KEY("hedge_delay=%ld",   hedge_delay),
+  NETWORKFS_OPT_KEY("retries=%ld",       retries),
+  NETWORKFS_OPT_KEY("retry_delay=%ld",   retry_delay),
+
+  NETWORKFS_OPT_KEY("breaker_threshold=%ld", breaker_threshold),
+  NETWORKFS_OPT_KEY("breaker_probe=%ld",     breaker_probe),
+
+  NETWORKFS_OPT_KEY("tls_session_cache=%s", tls_session_cache),
+  NETWORKFS_OPT_KEY("tcp_fastopen",         tcp_fastopen),
+  NETWORKFS_OPT_KEY("early_data",           early_data),
 
   // ssl_version
   NETWORKFS_OPT("tlsv1.3", ssl_version, CURL_SSLVERSION_TLSv1_3),
@@ -151,9 +190,41 @@ static void usage (const char *progname) {
 "    -o user=STR            set/override server username\n"
 "    -o username=STR        set/override server username\n"
 "    -o password=STR        set/override server password\n"
+"    -o anyauth             pick \"any\" authentication method\n"
+"    -o basic               use Basic authentication, sent without waiting for\n"
+"                           a challenge (default)\n"
+"    -o digest              use Digest authentication, the nonce is kept per\n"
+"                           pooled handle, so each one is challenged once\n"
+"    -o ntlm                use NTLM authentication\n"
+"    -o cookies             keep session cookies in memory and share them\n"
+"                           between connections\n"
+"    -o expect=N            ask before uploading N bytes or more with\n"
+"                           Expect: 100-continue, 0 to never ask (0)\n"
+"    -o (no_)compress       (do not) ask for compressed metadata (yes)\n"
+"    -o compress_data       ask for compressed file contents as well, only for\n"
+"                           servers which do not compress partial responses\n"
 // -- main --
 "    -o (no_)hide_password  (do not) hide password from ps (yes)\n"
 "    -o use_lock            use WebDAV lock\n"
+"    -o use_etag            make writes conditional on the ETag seen at open\n"
+"                           instead, they fail with ESTALE after a concurrent\n"
+"                           change (ignored with use_lock)\n"
+"    -o lock_timeout=T      lock lifetime asked from the server, refreshed while\n"
+"                           held (600s)\n"
+"    -o lock_linger=T       keep a lock T seconds after the last close for the\n"
+"                           next open, 0 to unlock on close (30s)\n"
+"    -o defer_create=N      keep new files locally until closed and upload them\n"
+"                           with a single PUT, unless they grow past N bytes;\n"
+"                           0 to create them on the server at once (0)\n"
+"    -o save_delay=T        with defer_create, hold new files T seconds past\n"
+"                           their close, a rename meanwhile uploads them under\n"
+"                           the new name only; 0 to upload at close (0)\n"
+"    -o attr_delay=T        write mode, owner and times changes together at most\n"
+"                           T seconds later, or at close, 0 at once; a failed\n"
+"                           write is retried until fsync or close reports it\n"
+"                           (1.0s)\n"
+"    -o writeback_cache     let the kernel gather writes into larger ones before\n"
+"                           sending them\n"
 // -- fuse --
 "    -o set_uid             override existing uid\n"
 "    -o set_gid             override existing gid\n"
@@ -204,6 +275,28 @@ static void usage (const char *progname) {
 "    -o connect_timeout=T   maximum time allowed for connection in seconds\n"
 "    -o initial_timeout=T   maximum time allowed for the first connection in\n"
 "                           seconds (5s)\n"
+"    -o meta_timeout=T      maximum time allowed for metadata operations\n"
+"    -o data_timeout=T      maximum time allowed for data transfers\n"
+// pool
+"    -o pool_max=N          maximum number of idle connections kept (16)\n"
+"    -o pool_min=N          number of idle connections kept open past\n"
+"                           pool_idle_timeout with a periodic HEAD (0)\n"
+"    -o pool_idle_timeout=T close idle connections after T seconds (60s)\n"
+// retry
+"    -o hedge               duplicate slow idempotent requests after the p95\n"
+"                           latency, the first answer wins\n"
+"    -o hedge_delay=MS      minimum delay before a duplicate is sent (10ms)\n"
+"    -o retries=N           retries for reset connections and 5xx (2)\n"
+"    -o retry_delay=MS      initial retry backoff, doubled each time (100ms)\n"
+// breaker
+"    -o breaker_threshold=N fail fast after N connection errors in a row, 0 to\n"
+"                           disable (3)\n"
+"    -o breaker_probe=T     probe an unreachable server every T seconds (5s)\n"
+// handshake
+"    -o tls_session_cache=F\n"
+"                           keep TLS sessions in file F across mounts\n"
+"    -o tcp_fastopen        send the first request in the TCP handshake\n"
+"    -o early_data          send idempotent requests as TLS 1.3 early data\n"
 "\n");
 }
 
@@ -218,6 +311,22 @@ static inline void options_set_default (void) {
 
   options.initial_timeout = 5;
 
+  options.pool_max = 16;
+  options.pool_idle_timeout = 60;
+
+  options.hedge_delay = 10;
+  options.retries = 2;
+  options.retry_delay = 100;
+
+  options.breaker_threshold = 3;
+  options.breaker_probe = 5;
+
+  options.compress = true;
+
+  options.lock_timeout = 600;
+  options.lock_linger = 30;
+  options.attr_delay = 1;
+
   options.hide_password = true;
 }
 
@@ -427,6 +536,20 @@ int main (int argc, char *argv[]) {
       replace_password(argc, argv);
     }
 
+    if (options.anyauth) {
+      options.httpauth = CURLAUTH_ANY;
+    } else {
+      if (options.basic) {
+        options.httpauth |= CURLAUTH_BASIC;
+      }
+      if (options.digest) {
+        options.httpauth |= CURLAUTH_DIGEST;
+      }
+      if (options.ntlm) {
+        options.httpauth |= CURLAUTH_NTLM;
+      }
+    }
+
     if (options.proxyanyauth) {
       options.proxyauth = CURLAUTH_ANY;
     } else {
@@ -449,7 +572,9 @@ int main (int argc, char *argv[]) {
     }
 
     // Initialize curl library before we are a multithreaded program
-    curl_global_init(CURL_GLOBAL_ALL);
+    if (curl_global_init_common((struct networkfs_opts *) &options)) {
+      throw NetworkFSException("curl_global_init failed");
+    }
     struct proto_operations *proto_oper_p;
     throwable proto_oper_p = get_proto_oper(options.scheme, (struct networkfs_opts *) &options);
     networkfs_oper_p = emulate_networkfs_oper(proto_oper_p);
@@ -486,6 +611,7 @@ int main (int argc, char *argv[]) {
 
     end:;
     ret = fuse_main(args.argc, args.argv, networkfs_oper_p, NULL);
+    curl_global_cleanup_common();
   } catch (NetworkFSException, e) {
     fprintf(stderr, "error: %s\n", e->what);
     ret = 1;
@@ -1,7 +1,9 @@
 #ifndef NETWORKFS_H
 #define NETWORKFS_H
 
+#include <limits.h>
 #include <stdio.h>
+#include <sys/ioctl.h>
 
 #include <grammar/exception.h>
 
@@ -10,6 +12,10 @@
 #define NETWORKFS_VERSION "0.0"
 #define NETWORKFS_URL "https://github.com/yangfl/networkfs/"
 #define DEFAULT_CACHE_TIMEOUT 2
+#define NETWORKFS_XATTR_STATS "user." NETWORKFS_NAME ".stats"
+/* copies the file or directory open at fd onto the path, taken from the root
+ * of the mount and passed in a buffer of PATH_MAX bytes, on the server */
+#define NETWORKFS_IOC_COPY _IOW('N', 1, char [PATH_MAX])
 
 
 typedef Exception NetworkFSException;
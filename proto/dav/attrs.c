@@ -0,0 +1,215 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <grammar/synchronized.h>
+#include "attrs.h"
+
+
+struct DavAttrsEntry {
+  HashMapEntry;
+  struct DavAttrUpdate update;
+  /* bumped by every change */
+  unsigned int version;
+  /* first change not written yet */
+  struct timespec since;
+  char path[];
+};
+
+
+static inline void dav_attrs_update (struct DavAttrUpdate *this, const struct DavAttrUpdate *update) {
+  if (update->set & DAV_ATTR_MODE) {
+    this->mode = update->mode;
+  }
+  if (update->set & DAV_ATTR_OWNER) {
+    this->uid = update->uid;
+    this->gid = update->gid;
+  }
+  if (update->set & DAV_ATTR_TIME) {
+    this->ctime = update->ctime;
+    this->mtime = update->mtime;
+    this->atime = update->atime;
+  }
+  this->set |= update->set;
+}
+
+
+int dav_attrs_merge (struct DavAttrs *attrs, const char *path, const struct DavAttrUpdate *update) {
+  size_t hash = HashMap_hash(path);
+  HashMapShard *shard = HashMap_shard(&attrs->map, hash);
+  int res = 0;
+
+  synchronized (mutex, &shard->lock, lock) {
+    struct DavAttrsEntry *entry = (struct DavAttrsEntry *) HashMapShard_find(shard, path, hash);
+    if (entry == NULL) {
+      size_t len = strlen(path);
+      entry = malloc(sizeof(struct DavAttrsEntry) + len + 1);
+      if unlikely (entry == NULL) {
+        res = -ENOMEM;
+        break;
+      }
+      memcpy(entry->path, path, len + 1);
+      entry->key = entry->path;
+      entry->hash = hash;
+      entry->update.set = 0;
+      entry->version = 0;
+      clock_gettime(CLOCK_MONOTONIC, &entry->since);
+      if unlikely (HashMapShard_insert(shard, (HashMapEntry *) entry)) {
+        free(entry);
+        res = -ENOMEM;
+        break;
+      }
+    }
+    dav_attrs_update(&entry->update, update);
+    entry->version++;
+  }
+  return res;
+}
+
+
+void dav_attrs_apply (struct DavAttrs *attrs, const char *path, struct stat *st) {
+  size_t hash = HashMap_hash(path);
+  HashMapShard *shard = HashMap_shard(&attrs->map, hash);
+
+  synchronized (mutex, &shard->lock, lock) {
+    if likely (shard->size == 0) {
+      break;
+    }
+    struct DavAttrsEntry *entry = (struct DavAttrsEntry *) HashMapShard_find(shard, path, hash);
+    if (entry == NULL) {
+      break;
+    }
+    const struct DavAttrUpdate *update = &entry->update;
+    if (update->set & DAV_ATTR_MODE) {
+      st->st_mode = update->mode & S_IFMT ? update->mode : (st->st_mode & S_IFMT) | update->mode;
+    }
+    if (update->set & DAV_ATTR_OWNER) {
+      st->st_uid = update->uid;
+      st->st_gid = update->gid;
+    }
+    if (update->set & DAV_ATTR_TIME) {
+      st->st_ctime = update->ctime;
+      st->st_mtime = update->mtime;
+      st->st_atime = update->atime;
+    }
+  }
+}
+
+
+bool dav_attrs_get (struct DavAttrs *attrs, const char *path, struct DavAttrUpdate *update, unsigned int *versionp) {
+  size_t hash = HashMap_hash(path);
+  HashMapShard *shard = HashMap_shard(&attrs->map, hash);
+  bool found = false;
+
+  synchronized (mutex, &shard->lock, lock) {
+    if likely (shard->size == 0) {
+      break;
+    }
+    struct DavAttrsEntry *entry = (struct DavAttrsEntry *) HashMapShard_find(shard, path, hash);
+    if (entry == NULL) {
+      break;
+    }
+    *update = entry->update;
+    *versionp = entry->version;
+    found = true;
+  }
+  return found;
+}
+
+
+void dav_attrs_written (struct DavAttrs *attrs, const char *path, unsigned int version) {
+  size_t hash = HashMap_hash(path);
+  HashMapShard *shard = HashMap_shard(&attrs->map, hash);
+  HashMapEntry *entry = NULL;
+
+  synchronized (mutex, &shard->lock, lock) {
+    struct DavAttrsEntry *found = (struct DavAttrsEntry *) HashMapShard_find(shard, path, hash);
+    /* changed again meanwhile, written the next time */
+    if (found && found->version == version) {
+      entry = HashMapShard_remove(shard, path, hash);
+    }
+  }
+  free(entry);
+}
+
+
+void dav_attrs_retry (struct DavAttrs *attrs, const char *path, unsigned int version) {
+  size_t hash = HashMap_hash(path);
+  HashMapShard *shard = HashMap_shard(&attrs->map, hash);
+
+  synchronized (mutex, &shard->lock, lock) {
+    struct DavAttrsEntry *entry = (struct DavAttrsEntry *) HashMapShard_find(shard, path, hash);
+    if (entry && entry->version == version) {
+      clock_gettime(CLOCK_MONOTONIC, &entry->since);
+    }
+  }
+}
+
+
+void dav_attrs_discard (struct DavAttrs *attrs, const char *path) {
+  size_t hash = HashMap_hash(path);
+  HashMapShard *shard = HashMap_shard(&attrs->map, hash);
+  HashMapEntry *entry = NULL;
+
+  synchronized (mutex, &shard->lock, lock) {
+    if likely (shard->size == 0) {
+      break;
+    }
+    entry = HashMapShard_remove(shard, path, hash);
+  }
+  free(entry);
+}
+
+
+size_t dav_attrs_due (struct DavAttrs *attrs, double delay, char ***pathsp) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  char **paths = NULL;
+  size_t npath = 0;
+  size_t capacity = 0;
+
+  for (int i = 0; i < HASHMAP_SHARDS; i++) {
+    HashMapShard *shard = &attrs->map.shards[i];
+    synchronized (mutex, &shard->lock, lock) {
+      foreach(HashMapShard) (entry_, shard) {
+        struct DavAttrsEntry *entry = (struct DavAttrsEntry *) entry_;
+        if ((now.tv_sec - entry->since.tv_sec) + (now.tv_nsec - entry->since.tv_nsec) / 1e9 < delay) {
+          continue;
+        }
+        if (npath == capacity) {
+          size_t new_capacity = capacity ? capacity * 2 : 16;
+          char **new_paths = realloc(paths, new_capacity * sizeof(char *));
+          if unlikely (new_paths == NULL) {
+            /* the rest waits for the next round */
+            break;
+          }
+          paths = new_paths;
+          capacity = new_capacity;
+        }
+        paths[npath] = strdup(entry->path);
+        if likely (paths[npath]) {
+          npath++;
+        }
+      }
+    }
+  }
+
+  *pathsp = paths;
+  return npath;
+}
+
+
+static void dav_attrs_free_entry (HashMapEntry *entry) {
+  free(entry);
+}
+
+
+void dav_attrs_destory (struct DavAttrs *attrs) {
+  HashMap_destory(&attrs->map, dav_attrs_free_entry);
+}
+
+
+int dav_attrs_init (struct DavAttrs *attrs) {
+  return HashMap_init(&attrs->map);
+}
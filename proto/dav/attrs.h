@@ -0,0 +1,52 @@
+#ifndef PROTO_DAV_ATTRS_H
+#define PROTO_DAV_ATTRS_H
+
+#include <stdbool.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <template/hashmap.h>
+
+
+enum DavAttrFlag {
+  DAV_ATTR_MODE  = 1 << 0,
+  DAV_ATTR_OWNER = 1 << 1,
+  DAV_ATTR_TIME  = 1 << 2,
+};
+
+/* attributes changed locally, `set` tells which */
+struct DavAttrUpdate {
+  unsigned int set;
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  time_t ctime;
+  time_t mtime;
+  time_t atime;
+};
+
+/* Attribute changes not written to the server yet. Those of one path are
+ * merged, so they go up in a single PROPPATCH. */
+struct DavAttrs {
+  HashMap map;
+};
+
+
+int dav_attrs_merge (struct DavAttrs *attrs, const char *path, const struct DavAttrUpdate *update);
+/* overrides the attributes in `st` with the pending ones */
+void dav_attrs_apply (struct DavAttrs *attrs, const char *path, struct stat *st);
+/* The changes to write, they still apply until dav_attrs_written is told
+ * about the `version` returned here. */
+bool dav_attrs_get (struct DavAttrs *attrs, const char *path, struct DavAttrUpdate *update, unsigned int *versionp);
+void dav_attrs_written (struct DavAttrs *attrs, const char *path, unsigned int version);
+/* writing `version` failed, it is due again a full delay from now */
+void dav_attrs_retry (struct DavAttrs *attrs, const char *path, unsigned int version);
+void dav_attrs_discard (struct DavAttrs *attrs, const char *path);
+/* paths changed at least `delay` seconds ago, for the caller to free */
+size_t dav_attrs_due (struct DavAttrs *attrs, double delay, char ***pathsp);
+
+void dav_attrs_destory (struct DavAttrs *attrs);
+int dav_attrs_init (struct DavAttrs *attrs);
+
+
+#endif /* PROTO_DAV_ATTRS_H */
@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <grammar/synchronized.h>
+#include "cache.h"
+
+
+struct DavCacheEntry {
+  HashMapEntry;
+  struct stat st;
+  struct timespec stamp;
+  /* empty if the response had none */
+  char etag[DAV_CACHE_ETAG_MAX];
+  /* of a symlink, if the server kept it */
+  char *target;
+  /* the version the kernel got at the last open, cleared once it changes */
+  bool opened;
+  struct timespec opened_mtime;
+  off_t opened_size;
+  char opened_etag[DAV_CACHE_ETAG_MAX];
+  char path[];
+};
+
+
+static inline double dav_cache_age (const struct timespec *stamp) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - stamp->tv_sec) + (now.tv_nsec - stamp->tv_nsec) / 1e9;
+}
+
+
+/* by ETag too where both have one, listings come without */
+static inline bool dav_cache_same (const struct DavCacheEntry *entry, const struct stat *st, const char *etag) {
+  return st->st_mtim.tv_sec == entry->opened_mtime.tv_sec &&
+         st->st_mtim.tv_nsec == entry->opened_mtime.tv_nsec &&
+         st->st_size == entry->opened_size &&
+         (etag == NULL || etag[0] == '\0' || entry->opened_etag[0] == '\0' ||
+          strcmp(etag, entry->opened_etag) == 0);
+}
+
+
+/* Removes an entry of a full shard, the oldest of the next non-empty bucket
+ * the clock hand of the shard comes across. Expects the shard lock. */
+static struct DavCacheEntry *dav_cache_evict (struct DavCache *cache, HashMapShard *shard) {
+  size_t *hand = &cache->hands[shard - cache->map.shards];
+
+  for (size_t i = 0; i < shard->nbucket; i++) {
+    size_t bucket = (*hand + i) % shard->nbucket;
+    struct DavCacheEntry *victim = NULL;
+    for (HashMapEntry *entry = shard->buckets[bucket]; entry; entry = entry->next) {
+      struct DavCacheEntry *candidate = (struct DavCacheEntry *) entry;
+      if (victim == NULL || candidate->stamp.tv_sec < victim->stamp.tv_sec ||
+          (candidate->stamp.tv_sec == victim->stamp.tv_sec &&
+           candidate->stamp.tv_nsec < victim->stamp.tv_nsec)) {
+        victim = candidate;
+      }
+    }
+    if (victim) {
+      *hand = bucket + 1;
+      return (struct DavCacheEntry *) HashMapShard_remove(shard, victim->key, victim->hash);
+    }
+  }
+  return NULL;
+}
+
+
+static void dav_cache_free_entry (HashMapEntry *entry) {
+  if (entry) {
+    free(((struct DavCacheEntry *) entry)->target);
+  }
+  free(entry);
+}
+
+
+void dav_cache_put (
+    struct DavCache *cache, const char *path, const struct stat *st, const char *etag, const char *target) {
+  size_t hash = HashMap_hash(path);
+  HashMapShard *shard = HashMap_shard(&cache->map, hash);
+  struct DavCacheEntry *evicted = NULL;
+  bool changed = false;
+
+  synchronized (mutex, &shard->lock, lock) {
+    struct DavCacheEntry *entry = (struct DavCacheEntry *) HashMapShard_find(shard, path, hash);
+    if (entry == NULL) {
+      if (shard->size >= cache->max_entries / HASHMAP_SHARDS) {
+        evicted = dav_cache_evict(cache, shard);
+      }
+
+      size_t len = strlen(path);
+      entry = malloc(sizeof(struct DavCacheEntry) + len + 1);
+      if unlikely (entry == NULL) {
+        break;
+      }
+      memcpy(entry->path, path, len + 1);
+      entry->key = entry->path;
+      entry->hash = hash;
+      entry->target = NULL;
+      entry->opened = false;
+      if unlikely (HashMapShard_insert(shard, (HashMapEntry *) entry)) {
+        free(entry);
+        break;
+      }
+    }
+    if (entry->opened && !dav_cache_same(entry, st, etag)) {
+      entry->opened = false;
+      changed = true;
+    }
+    entry->st = *st;
+    if (etag && strlen(etag) < sizeof(entry->etag)) {
+      strcpy(entry->etag, etag);
+    } else {
+      entry->etag[0] = '\0';
+    }
+    if (target == NULL || entry->target == NULL || strcmp(target, entry->target) != 0) {
+      free(entry->target);
+      /* simply not cached without memory */
+      entry->target = target ? strdup(target) : NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &entry->stamp);
+  }
+
+  dav_cache_free_entry((HashMapEntry *) evicted);
+  if (changed && cache->changed) {
+    cache->changed(path);
+  }
+}
+
+
+void dav_cache_put_child (
+    struct DavCache *cache, const char *dir, const char *name, const struct stat *st,
+    const char *etag, const char *target) {
+  if (name[0] == '\0') {
+    dav_cache_put(cache, dir, st, etag, target);
+    return;
+  }
+
+  size_t dir_len = strlen(dir);
+  if (dir_len > 0 && dir[dir_len - 1] == '/') {
+    dir_len--;
+  }
+  size_t name_len = strlen(name);
+
+  char path[dir_len + name_len + 2];
+  memcpy(path, dir, dir_len);
+  path[dir_len] = '/';
+  memcpy(path + dir_len + 1, name, name_len + 1);
+  dav_cache_put(cache, path, st, etag, target);
+}
+
+
+bool dav_cache_get (struct DavCache *cache, const char *path, struct stat *st, bool allow_stale) {
+  size_t hash = HashMap_hash(path);
+  HashMapShard *shard = HashMap_shard(&cache->map, hash);
+  bool found = false;
+
+  synchronized (mutex, &shard->lock, lock) {
+    struct DavCacheEntry *entry = (struct DavCacheEntry *) HashMapShard_find(shard, path, hash);
+    if (entry && (allow_stale || dav_cache_age(&entry->stamp) < cache->timeout)) {
+      *st = entry->st;
+      found = true;
+    }
+  }
+
+  return found;
+}
+
+
+/* ETag of a fresh entry, into a buffer of DAV_CACHE_ETAG_MAX */
+bool dav_cache_get_etag (struct DavCache *cache, const char *path, char *etag) {
+  size_t hash = HashMap_hash(path);
+  HashMapShard *shard = HashMap_shard(&cache->map, hash);
+  bool found = false;
+
+  synchronized (mutex, &shard->lock, lock) {
+    struct DavCacheEntry *entry = (struct DavCacheEntry *) HashMapShard_find(shard, path, hash);
+    if (entry && entry->etag[0] != '\0' && dav_cache_age(&entry->stamp) < cache->timeout) {
+      strcpy(etag, entry->etag);
+      found = true;
+    }
+  }
+
+  return found;
+}
+
+
+/* symlink target into `buf`, truncated to fit */
+bool dav_cache_get_target (struct DavCache *cache, const char *path, char *buf, size_t size, bool allow_stale) {
+  size_t hash = HashMap_hash(path);
+  HashMapShard *shard = HashMap_shard(&cache->map, hash);
+  bool found = false;
+
+  synchronized (mutex, &shard->lock, lock) {
+    struct DavCacheEntry *entry = (struct DavCacheEntry *) HashMapShard_find(shard, path, hash);
+    if (entry && entry->target && (allow_stale || dav_cache_age(&entry->stamp) < cache->timeout)) {
+      snprintf(buf, size, "%s", entry->target);
+      found = true;
+    }
+  }
+
+  return found;
+}
+
+
+bool dav_cache_open (struct DavCache *cache, const char *path) {
+  size_t hash = HashMap_hash(path);
+  HashMapShard *shard = HashMap_shard(&cache->map, hash);
+  bool same = false;
+
+  synchronized (mutex, &shard->lock, lock) {
+    struct DavCacheEntry *entry = (struct DavCacheEntry *) HashMapShard_find(shard, path, hash);
+    if (entry == NULL || dav_cache_age(&entry->stamp) >= cache->timeout) {
+      break;
+    }
+    /* cleared by any change seen since */
+    same = entry->opened;
+    if (!same || entry->etag[0] != '\0') {
+      strcpy(entry->opened_etag, entry->etag);
+    }
+    entry->opened = true;
+    entry->opened_mtime = entry->st.st_mtim;
+    entry->opened_size = entry->st.st_size;
+  }
+
+  return same;
+}
+
+
+void dav_cache_invalidate (struct DavCache *cache, const char *path) {
+  size_t hash = HashMap_hash(path);
+  HashMapShard *shard = HashMap_shard(&cache->map, hash);
+  HashMapEntry *entry;
+
+  synchronized (mutex, &shard->lock, lock) {
+    entry = HashMapShard_remove(shard, path, hash);
+  }
+
+  dav_cache_free_entry(entry);
+}
+
+
+/* Stale listing of the cached children of path. Slow, only meant for when
+ * the server cannot be asked. The entries are copied out first, filler is
+ * not called with a shard locked. */
+int dav_cache_readdir (struct DavCache *cache, const char *path, void *buf, fuse_fill_dir_t filler) {
+  size_t path_len = strlen(path);
+  if (path_len > 0 && path[path_len - 1] == '/') {
+    path_len--;
+  }
+
+  struct stat st;
+  if (!dav_cache_get(cache, path, &st, true)) {
+    return 1;
+  }
+  filler(buf, ".", &st, 0, FUSE_FILL_DIR_PLUS);
+
+  struct DavCacheChild {
+    struct stat st;
+    char *name;
+  } *children = NULL;
+  size_t nchild = 0;
+  size_t capacity = 0;
+
+  for (int i = 0; i < HASHMAP_SHARDS; i++) {
+    HashMapShard *shard = &cache->map.shards[i];
+    synchronized (mutex, &shard->lock, lock) {
+      foreach(HashMapShard) (entry_, shard) {
+        struct DavCacheEntry *entry = (struct DavCacheEntry *) entry_;
+        if (strncmp(entry->path, path, path_len) != 0 || entry->path[path_len] != '/') {
+          continue;
+        }
+        const char *name = entry->path + path_len + 1;
+        if (name[0] == '\0' || strchr(name, '/')) {
+          continue;
+        }
+
+        /* simply not listed without memory */
+        if (nchild == capacity) {
+          size_t new_capacity = capacity ? capacity * 2 : 64;
+          struct DavCacheChild *new_children = realloc(children, new_capacity * sizeof(*children));
+          if unlikely (new_children == NULL) {
+            continue;
+          }
+          children = new_children;
+          capacity = new_capacity;
+        }
+        char *copy = strdup(name);
+        if likely (copy) {
+          children[nchild++] = (struct DavCacheChild) {.st = entry->st, .name = copy};
+        }
+      }
+    }
+  }
+
+  for (size_t i = 0; i < nchild; i++) {
+    filler(buf, children[i].name, &children[i].st, 0, FUSE_FILL_DIR_PLUS);
+    free(children[i].name);
+  }
+  free(children);
+
+  return 0;
+}
+
+
+void dav_cache_destory (struct DavCache *cache) {
+  HashMap_destory(&cache->map, dav_cache_free_entry);
+}
+
+
+int dav_cache_init (struct DavCache *cache, double timeout, size_t max_entries) {
+  cache->timeout = timeout;
+  cache->max_entries = max_entries < HASHMAP_SHARDS ? HASHMAP_SHARDS : max_entries;
+  cache->changed = NULL;
+  memset(cache->hands, 0, sizeof(cache->hands));
+  return HashMap_init(&cache->map);
+}
@@ -0,0 +1,50 @@
+#ifndef PROTO_DAV_CACHE_H
+#define PROTO_DAV_CACHE_H
+
+#include <stdbool.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 31
+#endif
+
+#include <fuse.h>
+
+#include <template/hashmap.h>
+
+
+/* longer entity tags are not kept */
+#define DAV_CACHE_ETAG_MAX 64
+
+/* Attributes seen in PROPFIND responses. Entries are kept after they
+ * expire, so they can still be served while the server is unreachable. */
+struct DavCache {
+  HashMap map;
+  double timeout;
+  size_t max_entries;
+  /* bucket of each shard the next eviction starts from */
+  size_t hands[HASHMAP_SHARDS];
+  /* told about an opened file found changed on the server, if set */
+  void (*changed) (const char *path);
+};
+
+
+void dav_cache_put (
+  struct DavCache *cache, const char *path, const struct stat *st, const char *etag, const char *target);
+void dav_cache_put_child (
+  struct DavCache *cache, const char *dir, const char *name, const struct stat *st,
+  const char *etag, const char *target);
+bool dav_cache_get (struct DavCache *cache, const char *path, struct stat *st, bool allow_stale);
+bool dav_cache_get_etag (struct DavCache *cache, const char *path, char *etag);
+bool dav_cache_get_target (struct DavCache *cache, const char *path, char *buf, size_t size, bool allow_stale);
+/* Remembers the fresh entry of path as opened. True if it did not change
+ * since the last open, so the pages the kernel kept of it still hold. */
+bool dav_cache_open (struct DavCache *cache, const char *path);
+void dav_cache_invalidate (struct DavCache *cache, const char *path);
+int dav_cache_readdir (struct DavCache *cache, const char *path, void *buf, fuse_fill_dir_t filler);
+void dav_cache_destory (struct DavCache *cache);
+int dav_cache_init (struct DavCache *cache, double timeout, size_t max_entries);
+
+
+#endif /* PROTO_DAV_CACHE_H */
@@ -6,11 +6,17 @@
 #include <utils.h>
 #include <wrapper/log.h>
 #include <grammar/try.h>
+#include <grammar/synchronized.h>
 #include <template/buffer.h>
+#include <template/singleflight.h>
 #include <wrapper/curl.h>
 #include <wrapper/fuse.h>
+#include "../../networkfs.h"
+#include "attrs.h"
 #include "dav.h"
+#include "listing.h"
 #include "method.h"
+#include "newfile.h"
 #include "parser.h"
 
 #ifdef DEBUG
@@ -21,6 +27,85 @@
 
 static struct DavServer server = {0};
 
+/* Listings waiting for a download, served in order by at most
+ * DAV_LISTING_WORKERS threads, started as opendir needs them. They finish
+ * the queue before the server goes away. */
+#define DAV_LISTING_WORKERS 4
+static struct {
+  struct DavListing *queue;
+  struct DavListing **tail;
+  unsigned int nqueued;
+  pthread_t threads[DAV_LISTING_WORKERS];
+  unsigned int nthread;
+  unsigned int idle;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool stop;
+} dav_downloads = {
+  .tail = &dav_downloads.queue,
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+};
+
+#define DAV_CACHE_MAX_ENTRIES 65536
+
+/* identical getattr and read calls share one request while in flight */
+static SingleFlight dav_flights;
+
+/* Bumped after every change, so that a call issued afterwards never joins
+ * a flight that may have seen the old content. Paths share the slots. */
+#define DAV_FLIGHT_GENERATIONS 64
+static atomic_uint dav_flight_generations[DAV_FLIGHT_GENERATIONS];
+
+/* new files waiting for their first close, with defer_create, or held past
+ * it with save_delay */
+static struct DavNewFiles dav_newfiles;
+/* fi->fh of a handle which created one */
+#define DAV_FH_NEWFILE 1
+
+/* mode, owner and times changes not written yet, with attr_delay */
+static struct DavAttrs dav_attrs;
+static struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool running;
+  bool stop;
+} dav_writeback = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+};
+
+
+static inline bool dav_newfile_hold (void) {
+  /* the writeback thread sends them at last */
+  return server.options->save_delay > 0 && dav_writeback.running;
+}
+
+
+/* for notifications from threads of our own */
+static struct fuse *dav_fuse;
+
+/* Paths whose pages the kernel has to drop. fuse_invalidate_path waits for
+ * the kernel, which may in turn wait for the very operation that noticed
+ * the change, so they are sent from a thread of their own. */
+struct DavInvalidation {
+  struct DavInvalidation *next;
+  char path[];
+};
+
+static struct {
+  struct DavInvalidation *queue;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool running;
+  bool stop;
+} dav_invalidator = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+};
+
 
 static void __attribute__((constructor)) dav_load (void) {
   LIBXML_TEST_VERSION
@@ -34,13 +119,20 @@ static inline int dav_exception_map () {
   int res;
 
   do_once {
+    if (issubtype(Exception, &ex, CurlException) && ((CurlException *) &ex)->code == CURLE_CIRCUIT_OPEN) {
+      /* the server is known to be down, do not flood the log */
+      res = -EIO;
+      break;
+    }
+
     if (issubtype(Exception, &ex, CurlException) && ((CurlException *) &ex)->code == CURLE_HTTP_RETURNED_ERROR) {
       switch (((CurlException *) &ex)->response_code) {
         case 404:  /* Not Found */
           res = -ENOENT;
           break;
         case 412:  /* Precondition Failed */
-          res = -EEXIST;
+          /* changed by someone else since we opened it, or our lock is gone */
+          res = -ESTALE;
           break;
         case 423:  /* Locked */
           res = -EBUSY;
@@ -62,6 +154,9 @@ static inline int dav_exception_map () {
 
     if (issubtype(Exception, &ex, MallocException)) {
       res = -ENOMEM;
+    } else if (issubtype(Exception, &ex, CurlException) &&
+               ((CurlException *) &ex)->code == CURLE_OPERATION_TIMEDOUT) {
+      res = -ETIMEDOUT;
     } else {
       res = -EIO;
     }
@@ -89,13 +184,393 @@ static inline int dav_exception_check (int res) {
 }
 
 
+/* the server could not be reached, answers may come from the cache */
+static inline bool dav_exception_unreachable () {
+  if (!Exception_has(&ex) || !issubtype(Exception, &ex, CurlException)) {
+    return false;
+  }
+
+  switch (((CurlException *) &ex)->code) {
+    case CURLE_CIRCUIT_OPEN:
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+      return true;
+    default:
+      return false;
+  }
+}
+
+
+static inline unsigned int dav_flight_generation (const char *path) {
+  return atomic_load(&dav_flight_generations[HashMap_hash(path) % DAV_FLIGHT_GENERATIONS]);
+}
+
+
+static inline void dav_changed (const char *path) {
+  dav_cache_invalidate(&server.cache, path);
+  atomic_fetch_add(&dav_flight_generations[HashMap_hash(path) % DAV_FLIGHT_GENERATIONS], 1);
+}
+
+
+/* buffers to format the properties of an update into */
+struct DavAttrValues {
+  char mode[19];
+  char owner[22];
+  char time[64];
+};
+
+static size_t dav_attrs_props (
+    const struct DavAttrUpdate *update, struct DavAttrValues *values, struct DavPropUpdate *props) {
+  size_t n = 0;
+
+  if (update->set & DAV_ATTR_MODE) {
+    snprintf(values->mode, sizeof(values->mode), "%o", update->mode);
+    props[n++] = (struct DavPropUpdate) {"N:mode", values->mode};
+  }
+  if (update->set & DAV_ATTR_OWNER) {
+    snprintf(values->owner, sizeof(values->owner), "%d:%d", update->uid, update->gid);
+    props[n++] = (struct DavPropUpdate) {"N:owner", values->owner};
+  }
+  if (update->set & DAV_ATTR_TIME) {
+    snprintf(values->time, sizeof(values->time), "%jd %jd %jd",
+             (intmax_t) update->ctime, (intmax_t) update->mtime, (intmax_t) update->atime);
+    props[n++] = (struct DavPropUpdate) {"N:time", values->time};
+  }
+  return n;
+}
+
+
+/* sends a new file still kept locally to `to`, which is `path` unless it is
+ * renamed, replacing what is there if `replace`; anything but reading and
+ * writing it needs it on the server first */
+static bool __dav_newfile_upload (const char *path, const char *to, bool replace, int *resp) {
+  struct DavNewFile *file = dav_newfile_take(&dav_newfiles, path);
+  if (file == NULL) {
+    return false;
+  }
+
+  int res = dav_exception_test(replace ?
+    dav_put_whole(&server, to, file->data, file->size) :
+    dav_put_new(&server, to, file->data, file->size));
+  if (res == -ESTALE && !replace) {
+    /* If-None-Match: someone else created it meanwhile */
+    res = -EEXIST;
+  }
+  if unlikely (res && (to != path || res != -EEXIST)) {
+    /* kept for another attempt, or where it was if the rename failed; only
+     * a file someone else created meanwhile wins over it */
+    dav_newfile_return(&dav_newfiles, file);
+    *resp = res;
+    return true;
+  }
+
+  /* attributes changed meanwhile go in the same PROPPATCH */
+  struct DavAttrUpdate update = {.set = 0};
+  unsigned int version;
+  bool pending = dav_attrs_get(&dav_attrs, path, &update, &version);
+  /* a replaced file keeps its properties over a PUT */
+  if (!(update.set & DAV_ATTR_MODE) &&
+      (replace || file->mode != ((S_IFREG | 0777) & ~server.options->fmask))) {
+    update.set |= DAV_ATTR_MODE;
+    update.mode = file->mode;
+  }
+  if (!(update.set & DAV_ATTR_TIME) && replace) {
+    update.set |= DAV_ATTR_TIME;
+    update.ctime = update.mtime = update.atime = file->mtime;
+  }
+  int attrs_res = 0;
+  if (res == 0 && update.set) {
+    struct DavAttrValues values;
+    struct DavPropUpdate props[3];
+    attrs_res = dav_exception_test(dav_proppatch_n(&server, to, props, dav_attrs_props(&update, &values, props)));
+  }
+  if (pending) {
+    dav_attrs_written(&dav_attrs, path, version);
+  }
+  if (res == 0 && to != path) {
+    /* those of the file replaced */
+    dav_attrs_discard(&dav_attrs, to);
+  }
+  if unlikely (attrs_res) {
+    /* the content is there, the attributes are written back later like
+     * any other change */
+    dav_attrs_merge(&dav_attrs, to, &update);
+  }
+  dav_newfile_done(&dav_newfiles, file);
+  dav_changed(path);
+  if (to != path) {
+    dav_changed(to);
+  }
+  *resp = res;
+  return true;
+}
+
+
+static int dav_newfile_upload (const char *path) {
+  int res = 0;
+  __dav_newfile_upload(path, path, false, &res);
+  return res;
+}
+
+
+/* sends the held files closed at least `delay` seconds ago, all if
+ * negative, those directly in `dir` unless NULL */
+static void dav_newfile_upload_due (double delay, const char *dir) {
+  char **paths;
+  size_t npath = dav_newfile_due(&dav_newfiles, delay, dir, &paths);
+  for (size_t i = 0; i < npath; i++) {
+    int res = dav_newfile_upload(paths[i]);
+    if unlikely (res) {
+      /* nobody is left to tell, a new file is kept for another attempt
+       * unless the unmount was its last chance */
+      fprintf(stderr, "Error uploading %s: %s%s\n", paths[i], strerror(-res),
+              delay < 0 || res == -EEXIST ? ", content lost" : "");
+    }
+    free(paths[i]);
+  }
+  free(paths);
+}
+
+
+/* writes the pending attribute changes of path. Unless `keep`, they are
+ * dropped if they cannot be written, like they would have been at once,
+ * and the error goes to the caller. */
+static int __dav_attrs_flush (const char *path, bool keep) {
+  struct DavAttrUpdate update;
+  unsigned int version;
+  if (!dav_attrs_get(&dav_attrs, path, &update, &version)) {
+    return 0;
+  }
+
+  struct DavAttrValues values;
+  struct DavPropUpdate props[3];
+  int res = dav_exception_test(dav_proppatch_n(&server, path, props, dav_attrs_props(&update, &values, props)));
+  if unlikely (res && keep && res != -ENOENT) {
+    dav_attrs_retry(&dav_attrs, path, version);
+  } else {
+    dav_attrs_written(&dav_attrs, path, version);
+  }
+  dav_changed(path);
+  return res;
+}
+
+
+static inline int dav_attrs_flush (const char *path) {
+  return __dav_attrs_flush(path, false);
+}
+
+
+static int dav_attrs_set (const char *path, const struct DavAttrUpdate *update) {
+  struct stat st;
+  /* a new file takes them along when uploaded */
+  if (server.options->attr_delay <= 0 && !dav_newfile_getattr(&dav_newfiles, path, &st)) {
+    struct DavAttrValues values;
+    struct DavPropUpdate props[3];
+    int res = dav_exception_test(dav_proppatch_n(&server, path, props, dav_attrs_props(update, &values, props)));
+    dav_changed(path);
+    return res;
+  }
+
+  return dav_attrs_merge(&dav_attrs, path, update);
+}
+
+
+static void *dav_writeback_run (void *arg) {
+  while (true) {
+    bool stop;
+    synchronized (mutex, &dav_writeback.lock, lock) {
+      if (!dav_writeback.stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        double delay = server.options->attr_delay;
+        if (delay <= 0 || (server.options->save_delay > 0 && server.options->save_delay < delay)) {
+          delay = server.options->save_delay;
+        }
+        delay /= 2;
+        deadline.tv_sec += (time_t) delay;
+        deadline.tv_nsec += (long) ((delay - (time_t) delay) * 1e9);
+        if (deadline.tv_nsec >= 1000000000) {
+          deadline.tv_sec++;
+          deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&dav_writeback.cond, &dav_writeback.lock, &deadline);
+      }
+      stop = dav_writeback.stop;
+    }
+
+    /* everything left once stopping, files before the attributes riding
+     * along with them */
+    dav_newfile_upload_due(stop ? -1 : server.options->save_delay, NULL);
+    char **paths;
+    size_t npath = dav_attrs_due(&dav_attrs, stop ? 0 : server.options->attr_delay, &paths);
+    for (size_t i = 0; i < npath; i++) {
+      struct stat st;
+      /* goes up with the file instead */
+      if (stop || !dav_newfile_getattr(&dav_newfiles, paths[i], &st)) {
+        /* kept until the next fsync or close reports the error */
+        int res = __dav_attrs_flush(paths[i], !stop);
+        if unlikely (res) {
+          fprintf(stderr, "Error writing the attributes of %s: %s%s\n", paths[i], strerror(-res),
+                  stop || res == -ENOENT ? ", dropped" : "");
+        }
+      }
+      free(paths[i]);
+    }
+    free(paths);
+
+    if (stop) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+
+static void dav_listing_download (struct DavListing *listing) {
+  /* closed while waiting in the queue */
+  if unlikely (dav_listing_cancelled(listing)) {
+    dav_listing_finish(listing, -EINTR);
+    dav_listing_release(listing);
+    return;
+  }
+
+  dav_propfind(&server, listing->path, 1, listing, dav_listing_filler);
+  /* only ".." so far, the cached children are better than nothing */
+  if unlikely (dav_exception_unreachable() && listing->nentry <= 1 &&
+               dav_cache_readdir(&server.cache, listing->path, listing, dav_listing_filler) == 0) {
+    Exception_destory(&ex);
+  }
+  dav_listing_finish(listing, dav_exception_check(0));
+  dav_listing_release(listing);
+}
+
+
+static void *dav_listing_worker (void *arg) {
+  while (true) {
+    struct DavListing *listing;
+    synchronized (mutex, &dav_downloads.lock, lock) {
+      dav_downloads.idle++;
+      while (dav_downloads.queue == NULL && !dav_downloads.stop) {
+        pthread_cond_wait(&dav_downloads.cond, &dav_downloads.lock);
+      }
+      dav_downloads.idle--;
+
+      listing = dav_downloads.queue;
+      if (listing) {
+        dav_downloads.queue = listing->next;
+        if (dav_downloads.queue == NULL) {
+          dav_downloads.tail = &dav_downloads.queue;
+        }
+        dav_downloads.nqueued--;
+      }
+    }
+    if (listing == NULL) {
+      break;
+    }
+    dav_listing_download(listing);
+  }
+
+  return NULL;
+}
+
+
+static int dav_opendir (const char *path, struct fuse_file_info *fi) {
+    DBG("dav_opendir %s\n",path);
+  struct DavListing *listing = dav_listing_new(path);
+  if unlikely (listing == NULL) {
+    return -ENOMEM;
+  }
+  dav_listing_filler(listing, "..", NULL, 0, 0);
+
+  if (dav_newfile_hold()) {
+    /* held files are not listed until they are on the server */
+    dav_newfile_upload_due(0, path);
+  }
+
+  /* the listing downloads in the background, readdir serves what arrived */
+  bool queued = false;
+  synchronized (mutex, &dav_downloads.lock, lock) {
+    if (dav_downloads.idle <= dav_downloads.nqueued && dav_downloads.nthread < DAV_LISTING_WORKERS &&
+        pthread_create(&dav_downloads.threads[dav_downloads.nthread], NULL, dav_listing_worker, NULL) == 0) {
+      dav_downloads.nthread++;
+    }
+    if unlikely (dav_downloads.nthread == 0) {
+      break;
+    }
+
+    listing->next = NULL;
+    *dav_downloads.tail = listing;
+    dav_downloads.tail = &listing->next;
+    dav_downloads.nqueued++;
+    pthread_cond_signal(&dav_downloads.cond);
+    queued = true;
+  }
+  if unlikely (!queued) {
+    dav_listing_release(listing);
+    dav_listing_release(listing);
+    return -EAGAIN;
+  }
+
+  fi->fh = (uint64_t) listing;
+  return 0;
+}
+
+
+/* readdirplus stands in for getattr, so it sees the attribute changes not
+ * written yet as well */
+struct DavReaddirContext {
+  const char *path;
+  void *buf;
+  fuse_fill_dir_t filler;
+};
+
+static int dav_readdir_filler (
+    void *buf, const char *name, const struct stat *st, off_t off, enum fuse_fill_dir_flags flags) {
+  struct DavReaddirContext *context = (struct DavReaddirContext *) buf;
+  if (!(flags & FUSE_FILL_DIR_PLUS)) {
+    return context->filler(context->buf, name, st, off, flags);
+  }
+
+  struct stat applied = *st;
+  if (strcmp(name, ".") == 0) {
+    dav_attrs_apply(&dav_attrs, context->path, &applied);
+  } else {
+    size_t len = strlen(context->path);
+    char path[len + strlen(name) + 2];
+    /* the root ends in a slash already */
+    snprintf(path, sizeof(path), "%s%s%s", context->path, context->path[len - 1] == '/' ? "" : "/", name);
+    dav_attrs_apply(&dav_attrs, path, &applied);
+  }
+  return context->filler(context->buf, name, &applied, off, flags);
+}
+
+
 static int dav_readdir (const char *path, void *buf, fuse_fill_dir_t filler,
                         off_t offset, struct fuse_file_info *fi,
                         enum fuse_readdir_flags flags) {
-    DBG("dav_readdir %s\n",path);
-  filler(buf, "..", NULL, 0, 0);
-  dav_propfind(&server, path, 1, buf, filler);
-  return dav_exception_check(0);
+    DBG("dav_readdir %s+%zd\n",path,offset);
+  struct DavListing *listing = (struct DavListing *) fi->fh;
+  if (!(flags & FUSE_READDIR_PLUS)) {
+    return dav_listing_fill(listing, offset, buf, filler, false);
+  }
+
+  struct DavReaddirContext context = {
+    .path = listing->path,
+    .buf = buf,
+    .filler = filler,
+  };
+  return dav_listing_fill(listing, offset, &context, dav_readdir_filler, true);
+}
+
+
+static int dav_releasedir (const char *path, struct fuse_file_info *fi) {
+    DBG("dav_releasedir %s\n",path);
+  struct DavListing *listing = (struct DavListing *) fi->fh;
+  dav_listing_cancel(listing);
+  dav_listing_release(listing);
+  return 0;
 }
 
 
@@ -107,21 +582,52 @@ static int dav_getattr_callback (
 }
 
 
-static int dav_getattr (const char *path, struct stat *stbuf,
-                        struct fuse_file_info *fi) {
-    DBG("dav_getattr %s\n",path);
+static int __dav_getattr (const char *path, struct stat *stbuf) {
   dav_propfind(&server, path, 0, stbuf, dav_getattr_callback);
+  if unlikely (dav_exception_unreachable() &&
+               dav_cache_get(&server.cache, path, stbuf, true)) {
+    Exception_destory(&ex);
+    return 0;
+  }
   return dav_exception_check(0);
 }
 
 
-static int dav_read (const char *path, char *buf, size_t size, off_t offset,
-                     struct fuse_file_info *fi) {
-    DBG("dav_read %s %zd+%zd\n",path,offset,size);
-  if unlikely (size == 0) {
-    return 0;
+static int dav_getattr (const char *path, struct stat *stbuf,
+                        struct fuse_file_info *fi) {
+    DBG("dav_getattr %s\n",path);
+  int res;
+
+  if (dav_newfile_getattr(&dav_newfiles, path, stbuf)) {
+    stbuf->st_uid = server.options->uid;
+    stbuf->st_gid = server.options->gid;
+    res = 0;
+  } else {
+    char key[strlen(path) + 24];
+    snprintf(key, sizeof(key), "%u PROPFIND %s", dav_flight_generation(path), path);
+
+    bool leader;
+    SingleFlightCall *call = SingleFlight_join(&dav_flights, key, &leader);
+    if (!leader) {
+      res = call->res;
+      if (res == 0) {
+        memcpy(stbuf, call->result, sizeof(struct stat));
+      }
+      SingleFlight_leave(&dav_flights, call);
+    } else {
+      res = __dav_getattr(path, stbuf);
+      SingleFlight_finish(&dav_flights, call, res, stbuf);
+    }
   }
 
+  if (res == 0) {
+    dav_attrs_apply(&dav_attrs, path, stbuf);
+  }
+  return res;
+}
+
+
+static int __dav_read (const char *path, char *buf, size_t size, off_t offset) {
   ssize_t read_size = dav_get(&server, path, buf, size, offset);
   if unlikely (read_size < 0) {
     if (issubtype(Exception, &ex, CurlException) &&
@@ -138,11 +644,52 @@ static int dav_read (const char *path, char *buf, size_t size, off_t offset,
 }
 
 
+static int dav_read (const char *path, char *buf, size_t size, off_t offset,
+                     struct fuse_file_info *fi) {
+    DBG("dav_read %s %zd+%zd\n",path,offset,size);
+  if unlikely (size == 0) {
+    return 0;
+  }
+
+  int res;
+  if (dav_newfile_read(&dav_newfiles, path, buf, size, offset, &res)) {
+    return res;
+  }
+
+  char key[strlen(path) + 64];
+  snprintf(key, sizeof(key), "%u GET %jd+%zu %s", dav_flight_generation(path), (intmax_t) offset, size, path);
+
+  bool leader;
+  SingleFlightCall *call = SingleFlight_join(&dav_flights, key, &leader);
+  if (!leader) {
+    res = call->res;
+    if (res > 0) {
+      memcpy(buf, call->result, res);
+    }
+    SingleFlight_leave(&dav_flights, call);
+    return res;
+  }
+
+  res = __dav_read(path, buf, size, offset);
+  SingleFlight_finish(&dav_flights, call, res, buf);
+  return res;
+}
+
+
 static int dav_write (const char *path, const char *buf, size_t size,
                       off_t offset, struct fuse_file_info *fi) {
     DBG("dav_write %s %zd+%zd\n",path,offset,size);
   int res;
 
+  if (dav_newfile_write(&dav_newfiles, path, buf, size, offset)) {
+    return size;
+  }
+  /* too large to keep */
+  res = dav_newfile_upload(path);
+  if unlikely (res) {
+    return res;
+  }
+
   do_once {
     res = dav_put(&server, path, buf, size, offset);
 
@@ -176,6 +723,7 @@ static int dav_write (const char *path, const char *buf, size_t size,
     }
     res = dav_put(&server, path, buf, size, offset);
   }
+  dav_changed(path);
 
   if unlikely (res) {
     return dav_exception_map();
@@ -192,15 +740,31 @@ static int dav_mkdir (const char *path, mode_t mode) {
   }
 
   dav_mkcol(&server, path);
+  dav_changed(path);
   return dav_exception_check(0);
 }
 
 
 static int dav_rename (const char *from, const char *to, unsigned int flags) {
     DBG("dav_rename %s -> %s\n",from,to);
+  int res = dav_newfile_upload(to);
+  if unlikely (res) {
+    return res;
+  }
+  /* a new file goes up under the new name only, like an atomic save */
+  if ((flags == 0 || flags == RENAME_NOREPLACE) &&
+      __dav_newfile_upload(from, to, flags == 0, &res)) {
+    return res;
+  }
+
   if unlikely (!server.MOVE) {
     return -EOPNOTSUPP;
   }
+  /* the server moves them along */
+  res = dav_attrs_flush(from);
+  if unlikely (res) {
+    return res;
+  }
 
   switch (flags) {
     case 0:
@@ -208,10 +772,23 @@ static int dav_rename (const char *from, const char *to, unsigned int flags) {
       break;
     case RENAME_NOREPLACE:
       dav_move_nooverwrite(&server, from, to);
+      /* Overwrite: F fails with 412 if the destination exists */
+      if (issubtype(Exception, &ex, CurlException) &&
+          ((CurlException *) &ex)->code == CURLE_HTTP_RETURNED_ERROR &&
+          ((CurlException *) &ex)->response_code == 412) {
+        Exception_destory(&ex);
+        return -EEXIST;
+      }
       break;
     default:
       return -EINVAL;
   }
+  dav_changed(from);
+  dav_changed(to);
+  if likely (!Exception_has(&ex)) {
+    /* those of the file replaced */
+    dav_attrs_discard(&dav_attrs, to);
+  }
 
   return dav_exception_check(0);
 }
@@ -219,26 +796,70 @@ static int dav_rename (const char *from, const char *to, unsigned int flags) {
 
 static int dav_unlink (const char *path) {
     DBG("dav_unlink %s\n",path);
+  dav_attrs_discard(&dav_attrs, path);
+  if (dav_newfile_discard(&dav_newfiles, path)) {
+    /* never made it to the server */
+    dav_changed(path);
+    return 0;
+  }
+
   dav_delete(&server, path);
+  dav_changed(path);
   return dav_exception_check(0);
 }
 
 
 static int dav_chmod (const char *path, mode_t mode, struct fuse_file_info *fi) {
     DBG("dav_chmod %s %o\n",path,mode);
-  char value[19];
-  snprintf(value, sizeof(value), "%o", mode);
-  dav_proppatch(&server, path, "N:mode", value);
-  return dav_exception_check(0);
+  struct DavAttrUpdate update = {
+    .set = DAV_ATTR_MODE,
+    .mode = mode,
+  };
+  return dav_attrs_set(path, &update);
 }
 
 
 static int dav_chown (const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi) {
     DBG("dav_chown %s %d:%d\n",path,uid,gid);
-  char value[22];
-  snprintf(value, sizeof(value), "%d:%d", uid, gid);
-  dav_proppatch(&server, path, "N:owner", value);
-  return dav_exception_check(0);
+  struct DavAttrUpdate update = {
+    .set = DAV_ATTR_OWNER,
+    .uid = uid,
+    .gid = gid,
+  };
+  return dav_attrs_set(path, &update);
+}
+
+
+static int dav_utimens (const char *path, const struct timespec tv[2], struct fuse_file_info *fi) {
+    DBG("dav_utimens %s\n",path);
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  struct DavAttrUpdate update = {
+    .set = DAV_ATTR_TIME,
+    .ctime = now.tv_sec,
+    .mtime = now.tv_sec,
+    .atime = now.tv_sec,
+  };
+  if (tv) {
+    /* N:time holds all three, the omitted ones are kept as they are */
+    if (tv[0].tv_nsec == UTIME_OMIT || tv[1].tv_nsec == UTIME_OMIT) {
+      struct stat st;
+      int res = dav_getattr(path, &st, fi);
+      if unlikely (res) {
+        return res;
+      }
+      update.atime = st.st_atime;
+      update.mtime = st.st_mtime;
+    }
+    if (tv[0].tv_nsec != UTIME_OMIT) {
+      update.atime = tv[0].tv_nsec == UTIME_NOW ? now.tv_sec : tv[0].tv_sec;
+    }
+    if (tv[1].tv_nsec != UTIME_OMIT) {
+      update.mtime = tv[1].tv_nsec == UTIME_NOW ? now.tv_sec : tv[1].tv_sec;
+    }
+  }
+  return dav_attrs_set(path, &update);
 }
 
 
@@ -248,6 +869,11 @@ static int dav_mknod (const char *path, mode_t mode, dev_t rdev) {
     return -EINVAL;
   }
 
+  int res = dav_newfile_upload(path);
+  if unlikely (res) {
+    return res;
+  }
+
   try {
     throwable try {
       throwable dav_head(&server, path, NULL);
@@ -269,6 +895,24 @@ static int dav_mknod (const char *path, mode_t mode, dev_t rdev) {
 static int dav_readlink (const char *path, char *buf, size_t size) {
   int res;
 
+  /* usually fetched along with the directory listing */
+  if (dav_cache_get_target(&server.cache, path, buf, size, false)) {
+    return 0;
+  }
+
+  struct stat st;
+  res = dav_getattr(path, &st, NULL);
+  if unlikely (res) {
+    return res;
+  }
+  if unlikely (!S_ISLNK(st.st_mode)) {
+    return -EINVAL;
+  }
+  if (dav_cache_get_target(&server.cache, path, buf, size, true)) {
+    return 0;
+  }
+
+  /* made before the target was kept as a property, the content has it */
   res = dav_read(path, buf, size - 1, 0, NULL);
   if unlikely (res < 0) {
     return res;
@@ -280,33 +924,31 @@ static int dav_readlink (const char *path, char *buf, size_t size) {
 
 
 static int dav_symlink (const char *from, const char *to) {
+    DBG("dav_symlink %s -> %s\n",to,from);
   int res;
 
-  try {
-    throwable dav_head(&server, to, NULL);
-    return -EEXIST;
-  } catch (CurlException, e) {
-    if (!(e->code == CURLE_HTTP_RETURNED_ERROR && (e->response_code == 404 || e->response_code == 403))) {
-      throw;
-    }
-  } onerror (e) { }
+  res = dav_newfile_upload(to);
+  if unlikely (res) {
+    return res;
+  }
 
-  do_once {
-    res = dav_mknod(to, S_IFLNK | 0777, 0);
-    if unlikely (res) {
-      break;
-    }
-    res = dav_write(to, from, strlen(from), 0, NULL);
-    if unlikely (res < 0) {
-      break;
-    }
-    return 0;
+  /* the content keeps the target too, for other clients */
+  res = dav_exception_test(dav_put_new(&server, to, from, strlen(from)));
+  if unlikely (res) {
+    /* If-None-Match */
+    return res == -ESTALE ? -EEXIST : res;
   }
-  // error
-  try {
+
+  char mode[19];
+  snprintf(mode, sizeof(mode), "%o", S_IFLNK | 0777);
+  const struct DavPropUpdate props[] = {
+    {"N:mode", mode},
+    {"N:target", from},
+  };
+  res = dav_exception_test(dav_proppatch_n(&server, to, props, sizeof(props) / sizeof(props[0])));
+  dav_changed(to);
+  if unlikely (res) {
     dav_unlink(to);
-  } catch (e) {
-    Exception_fputs(e, stderr);
   }
   return res;
 }
@@ -316,57 +958,43 @@ static int dav_truncate (const char *path, off_t size, struct fuse_file_info *fi
     DBG("dav_truncate %s %zd\n",path,size);
   int res;
 
-  struct stat st;
-  res = dav_getattr(path, &st, NULL);
+  if (dav_newfile_truncate(&dav_newfiles, path, size)) {
+    return 0;
+  }
+  res = dav_newfile_upload(path);
   if unlikely (res) {
     return res;
   }
-  if (st.st_size == size) {
-    return 0;
-  }
 
-  if (size == 0) {
-    res = dav_delete(&server, path);
-    if unlikely (res) {
-      return dav_exception_map();
-    }
-    res = dav_put_simple(&server, path);
-    if unlikely (res) {
-      return dav_exception_map();
-    }
-    res = dav_chmod(path, st.st_mode, fi);
-  } else {
-    size_t real_size;
-    res = dav_head(&server, path, &real_size);
-    if unlikely (res) {
-      return dav_exception_map();
-    }
-    if ((unsigned) size < real_size / 2) {
-      char buf[size];
-      res = dav_read(path, buf, size, 0, fi);
-      if unlikely (res) {
-        return res;
-      }
-      res = dav_unlink(path);
+  /* a size seen lately saves the PROPFIND, emptying needs none at all */
+  struct stat st;
+  if (!dav_cache_get(&server.cache, path, &st, false)) {
+    if (size == 0) {
+      st.st_size = -1;
+    } else {
+      res = dav_getattr(path, &st, NULL);
       if unlikely (res) {
         return res;
       }
-      res = dav_put(&server, path, buf, size, 0);
-    } else {
-      char s_size[11];
-      snprintf(s_size, sizeof(s_size), "%zd", size);
-      res = dav_proppatch(&server, path, "size", s_size);
     }
-    res = dav_exception_test(res);
+  }
+  if (st.st_size == size) {
+    return 0;
   }
 
-  return res;
+  if (size > st.st_size && st.st_size >= 0) {
+    res = dav_put_zeros(&server, path, st.st_size, size - st.st_size);
+  } else {
+    res = dav_put_prefix(&server, path, size);
+  }
+  dav_changed(path);
+  return dav_exception_test(res);
 }
 
 
 
 static inline int __dav_open (const char *path) {
-  if (!server.LOCK) {
+  if (!server.LOCK && !server.use_etag) {
     return 0;
   }
 
@@ -376,7 +1004,13 @@ static inline int __dav_open (const char *path) {
 
 static int dav_open (const char *path, struct fuse_file_info *fi) {
     DBG("dav_open %s\n",path);
-  int res = 0;
+  int res;
+
+  /* another handle, the file has to be shared from now on */
+  res = dav_newfile_upload(path);
+  if unlikely (res) {
+    return res;
+  }
 
   if (fi->flags & O_WRONLY || fi->flags & O_RDWR) {
     if (fi->flags & O_TRUNC) {
@@ -387,6 +1021,13 @@ static int dav_open (const char *path, struct fuse_file_info *fi) {
     }
   }
 
+  if (res == 0 && !(fi->flags & O_TRUNC)) {
+    /* the pages kept since the last open hold while the file is the same */
+    struct stat st;
+    if (dav_cache_get(&server.cache, path, &st, false) || dav_getattr(path, &st, fi) == 0) {
+      fi->keep_cache = dav_cache_open(&server.cache, path);
+    }
+  }
   return res;
 }
 
@@ -394,6 +1035,16 @@ static int dav_open (const char *path, struct fuse_file_info *fi) {
 static int dav_create (const char *path, mode_t mode, struct fuse_file_info *fi) {
   int res;
 
+  if (server.options->defer_create > 0 && (fi->flags & O_WRONLY || fi->flags & O_RDWR)) {
+    /* If-None-Match at upload stands in for the HEAD probe, and no lock is
+     * needed for a file nobody else sees yet */
+    res = dav_newfile_create(&dav_newfiles, path, mode);
+    if likely (res == 0) {
+      fi->fh = DAV_FH_NEWFILE;
+    }
+    return res;
+  }
+
   res = dav_mknod(path, mode, 0);
   if unlikely (res) {
     return res;
@@ -409,15 +1060,48 @@ static int dav_create (const char *path, mode_t mode, struct fuse_file_info *fi)
 
 static int dav_release (const char *path, struct fuse_file_info *fi) {
     DBG("dav_release %s\n",path);
-  if (!server.LOCK) {
-    return 0;
+  if (fi->fh == DAV_FH_NEWFILE) {
+    /* held for a rename, otherwise normally sent by flush already */
+    if (dav_newfile_hold() && dav_newfile_close(&dav_newfiles, path)) {
+      return 0;
+    }
+    if unlikely (dav_newfile_upload(path)) {
+      /* still kept, the write-back or the unmount tries again */
+      dav_newfile_close(&dav_newfiles, path);
+    }
+  }
+  int res = dav_attrs_flush(path);
+  if (fi->fh == DAV_FH_NEWFILE) {
+    return res;
+  }
+  if (!server.LOCK && !server.use_etag) {
+    return res;
   }
   if (!(fi->flags & O_WRONLY || fi->flags & O_RDWR)) {
-    return 0;
+    return res;
   }
 
   dav_unlock(&server, path);
-  return 0;
+  return res;
+}
+
+
+static int dav_flush (const char *path, struct fuse_file_info *fi) {
+  /* errors reach close() from here, not from release */
+  if (fi->fh == DAV_FH_NEWFILE) {
+    /* the attributes go up with the file */
+    return dav_newfile_hold() ? 0 : dav_newfile_upload(path);
+  }
+  return dav_attrs_flush(path);
+}
+
+
+static int dav_fsync (const char *path, int datasync, struct fuse_file_info *fi) {
+  int res = dav_newfile_upload(path);
+  if (res == 0) {
+    res = dav_attrs_flush(path);
+  }
+  return res;
 }
 
 
@@ -430,12 +1114,50 @@ static ssize_t dav_copy_file_range (
     return -EOPNOTSUPP;
   }
 
-  int res;
-  struct stat st_out = {.st_size = 0};
-  res = dav_getattr(path_out, &st_out, fi_out);
-  if (res && res != -ENOENT) {
+  int res = dav_newfile_upload(path_in);
+  if (res == 0) {
+    res = dav_newfile_upload(path_out);
+  }
+  if (res == 0) {
+    /* the server copies them along */
+    res = dav_attrs_flush(path_in);
+  }
+  if unlikely (res) {
     return res;
   }
+
+  struct stat st_in;
+  if (!dav_cache_get(&server.cache, path_in, &st_in, false)) {
+    res = dav_getattr(path_in, &st_in, fi_in);
+    if unlikely (res) {
+      return res;
+    }
+  }
+  if (offset_in >= st_in.st_size) {
+    return 0;
+  }
+  /* COPY takes the source up to its end, a shorter range is left to the
+   * read and write fallback */
+  if (len < (size_t) (st_in.st_size - offset_in)) {
+    return -EOPNOTSUPP;
+  }
+  len = st_in.st_size - offset_in;
+
+  struct stat st_out = {.st_size = 0};
+  if (!dav_cache_get(&server.cache, path_out, &st_out, false)) {
+    res = dav_getattr(path_out, &st_out, fi_out);
+    if (res && res != -ENOENT) {
+      return res;
+    }
+  }
+
+  /* the whole file onto one no longer than it, the copy is all there is */
+  if (offset_in == 0 && st_out.st_size <= st_in.st_size) {
+    res = dav_exception_test(dav_copy(&server, path_in, path_out));
+    dav_changed(path_out);
+    return res ? res : (ssize_t) len;
+  }
+
   if (len < (unsigned) st_out.st_size / 2) {
     return -EOPNOTSUPP;
   }
@@ -443,32 +1165,33 @@ static ssize_t dav_copy_file_range (
   char file_out_before[offset_out];
   if (sizeof(file_out_before)) {
     res = dav_read(path_out, file_out_before, sizeof(file_out_before), 0, fi_out);
-    if unlikely (res) {
+    if unlikely (res < 0) {
       return res;
     }
   }
   char file_out_after[offset_out + len < (unsigned) st_out.st_size ? st_out.st_size - len - offset_out : 0];
   if (sizeof(file_out_after)) {
-    res = dav_read(path_out, file_out_after, sizeof(file_out_after), offset_out, fi_out);
-    if unlikely (res) {
+    res = dav_read(path_out, file_out_after, sizeof(file_out_after), offset_out + len, fi_out);
+    if unlikely (res < 0) {
       return res;
     }
   }
 
   res = dav_exception_test(dav_copy(&server, path_in, path_out));
+  dav_changed(path_out);
   if unlikely (res) {
     return res;
   }
 
   if (sizeof(file_out_before)) {
     res = dav_write(path_out, file_out_before, sizeof(file_out_before), 0, fi_out);
-    if unlikely (res) {
+    if unlikely (res < 0) {
       return res;
     }
   }
   if (sizeof(file_out_after)) {
-    res = dav_write(path_out, file_out_after, sizeof(file_out_after), offset_out, fi_out);
-    if unlikely (res) {
+    res = dav_write(path_out, file_out_after, sizeof(file_out_after), offset_out + len, fi_out);
+    if unlikely (res < 0) {
       return res;
     }
   }
@@ -477,7 +1200,138 @@ static ssize_t dav_copy_file_range (
 }
 
 
+static int dav_ioctl (
+    const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+    unsigned int flags, void *data) {
+  if ((unsigned int) cmd != NETWORKFS_IOC_COPY) {
+    return -ENOTTY;
+  }
+  if unlikely (!server.COPY) {
+    return -EOPNOTSUPP;
+  }
+
+  const char *to = data;
+  if (memchr(to, '\0', _IOC_SIZE(NETWORKFS_IOC_COPY)) == NULL || to[0] != '/') {
+    return -EINVAL;
+  }
+    DBG("dav_ioctl copy %s -> %s\n",path,to);
+
+  int res = dav_newfile_upload(path);
+  if (res == 0) {
+    res = dav_newfile_upload(to);
+  }
+  if (res == 0) {
+    res = dav_attrs_flush(path);
+  }
+  if unlikely (res) {
+    return res;
+  }
+
+  /* no Depth is infinity, directories come with everything below */
+  res = dav_exception_test(dav_copy(&server, path, to));
+  dav_changed(to);
+  if likely (res == 0) {
+    dav_attrs_discard(&dav_attrs, to);
+  }
+  return res;
+}
+
+
+static int dav_getxattr (const char *path, const char *name, char *value, size_t size) {
+  if (strcmp(path, "/") != 0 || strcmp(name, NETWORKFS_XATTR_STATS) != 0) {
+    return -ENODATA;
+  }
+
+  char stats[1024];
+  int len = curl_stats_snprint(stats, sizeof(stats));
+  if (len >= (int) sizeof(stats)) {
+    len = sizeof(stats) - 1;
+  }
+  if (size == 0) {
+    return len;
+  }
+  if (size < (size_t) len) {
+    return -ERANGE;
+  }
+  memcpy(value, stats, len);
+  return len;
+}
+
+
+static void *dav_invalidator_run (void *arg) {
+  while (true) {
+    struct DavInvalidation *queue;
+    bool stop;
+    synchronized (mutex, &dav_invalidator.lock, lock) {
+      while (dav_invalidator.queue == NULL && !dav_invalidator.stop) {
+        pthread_cond_wait(&dav_invalidator.cond, &dav_invalidator.lock);
+      }
+      queue = dav_invalidator.queue;
+      dav_invalidator.queue = NULL;
+      stop = dav_invalidator.stop;
+    }
+
+    while (queue) {
+      struct DavInvalidation *next = queue->next;
+      /* nothing is cached past the unmount */
+      if (!stop) {
+        fuse_invalidate_path(dav_fuse, queue->path);
+      }
+      free(queue);
+      queue = next;
+    }
+
+    if (stop) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+
+/* the kernel may still hold pages of path from before */
+static void dav_remote_changed (const char *path) {
+    DBG("dav_remote_changed %s\n",path);
+  if (!dav_invalidator.running) {
+    return;
+  }
+
+  size_t len = strlen(path);
+  struct DavInvalidation *invalidation = malloc(sizeof(struct DavInvalidation) + len + 1);
+  if unlikely (invalidation == NULL) {
+    /* AUTO_INVAL_DATA still drops them at a getattr seeing the change */
+    return;
+  }
+  memcpy(invalidation->path, path, len + 1);
+
+  synchronized (mutex, &dav_invalidator.lock, lock) {
+    invalidation->next = dav_invalidator.queue;
+    dav_invalidator.queue = invalidation;
+    pthread_cond_signal(&dav_invalidator.cond);
+  }
+}
+
+
 static void *dav_init (struct fuse_conn_info *conn, struct fuse_config *cfg) {
+  dav_fuse = fuse_get_context()->fuse;
+  /* listings come with the attributes anyway */
+  if (conn->capable & FUSE_CAP_READDIRPLUS) {
+    conn->want |= FUSE_CAP_READDIRPLUS;
+  }
+  /* drops the pages once getattr sees another size or mtime */
+  if (conn->capable & FUSE_CAP_AUTO_INVAL_DATA) {
+    conn->want |= FUSE_CAP_AUTO_INVAL_DATA;
+  }
+  if (server.options->writeback_cache && conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
+    conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+  }
+  if (dav_fuse) {
+    dav_invalidator.running =
+      pthread_create(&dav_invalidator.thread, NULL, dav_invalidator_run, NULL) == 0;
+  }
+  server.cache.changed = dav_remote_changed;
+
   try {
     xmlInitParser();
 
@@ -488,6 +1342,11 @@ static void *dav_init (struct fuse_conn_info *conn, struct fuse_config *cfg) {
     DAV_METHOD
   #undef X
     DBG("\n");
+
+    if (server.options->attr_delay > 0 ||
+        (server.options->defer_create > 0 && server.options->save_delay > 0)) {
+      dav_writeback.running = pthread_create(&dav_writeback.thread, NULL, dav_writeback_run, NULL) == 0;
+    }
   } catch (e) {
     Exception_fputs(e, stderr);
     FUSE_EXIT();
@@ -498,7 +1357,38 @@ static void *dav_init (struct fuse_conn_info *conn, struct fuse_config *cfg) {
 
 
 static void dav_destroy (void *private_data) {
+  synchronized (mutex, &dav_downloads.lock, lock) {
+    dav_downloads.stop = true;
+    pthread_cond_broadcast(&dav_downloads.cond);
+  }
+  for (unsigned int i = 0; i < dav_downloads.nthread; i++) {
+    pthread_join(dav_downloads.threads[i], NULL);
+  }
+  dav_downloads.nthread = 0;
+  if (dav_writeback.running) {
+    /* writes whatever is left on its way out */
+    synchronized (mutex, &dav_writeback.lock, lock) {
+      dav_writeback.stop = true;
+      pthread_cond_signal(&dav_writeback.cond);
+    }
+    pthread_join(dav_writeback.thread, NULL);
+    dav_writeback.running = false;
+  } else {
+    /* files whose upload failed at close */
+    dav_newfile_upload_due(-1, NULL);
+  }
+  if (dav_invalidator.running) {
+    synchronized (mutex, &dav_invalidator.lock, lock) {
+      dav_invalidator.stop = true;
+      pthread_cond_signal(&dav_invalidator.cond);
+    }
+    pthread_join(dav_invalidator.thread, NULL);
+    dav_invalidator.running = false;
+  }
   dav_destory(&server);
+  SingleFlight_destory(&dav_flights);
+  dav_newfile_destory(&dav_newfiles);
+  dav_attrs_destory(&dav_attrs);
 }
 
 
@@ -514,10 +1404,24 @@ int dav_getoper (struct proto_operations *proto_oper, struct networkfs_opts *opt
   }
 
   server.options = options;
+  if unlikely (dav_cache_init(&server.cache, options->dir_timeout, DAV_CACHE_MAX_ENTRIES)) {
+    delete(CURLU) server.baseuh;
+    server.baseuh = NULL;
+    return 1;
+  }
+  if unlikely (SingleFlight_init(&dav_flights) || dav_newfile_init(&dav_newfiles, options->defer_create) ||
+               dav_attrs_init(&dav_attrs)) {
+    dav_cache_destory(&server.cache);
+    delete(CURLU) server.baseuh;
+    server.baseuh = NULL;
+    return 1;
+  }
 
   proto_oper->init            = dav_init;
   proto_oper->destroy         = dav_destroy;
+  proto_oper->opendir         = dav_opendir;
   proto_oper->readdir         = dav_readdir;
+  proto_oper->releasedir      = dav_releasedir;
   proto_oper->getattr         = dav_getattr;
   proto_oper->read            = dav_read;
   proto_oper->write           = dav_write;
@@ -527,14 +1431,19 @@ int dav_getoper (struct proto_operations *proto_oper, struct networkfs_opts *opt
   proto_oper->rmdir           = dav_unlink;
   proto_oper->chmod           = dav_chmod;
   proto_oper->chown           = dav_chown;
+  proto_oper->utimens         = dav_utimens;
   proto_oper->mknod           = dav_mknod;
   proto_oper->readlink        = dav_readlink;
   proto_oper->symlink         = dav_symlink;
   proto_oper->create          = dav_create;
   proto_oper->open            = dav_open;
   proto_oper->release         = dav_release;
+  proto_oper->flush           = dav_flush;
+  proto_oper->fsync           = dav_fsync;
   proto_oper->truncate        = dav_truncate;
   proto_oper->copy_file_range = dav_copy_file_range;
+  proto_oper->ioctl           = dav_ioctl;
+  proto_oper->getxattr        = dav_getxattr;
 
   return 0;
 }
@@ -0,0 +1,173 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <grammar/synchronized.h>
+#include "listing.h"
+
+
+#define DAV_LISTING_MIN_CAPACITY 64
+#define DAV_LISTING_MIN_NAMES_CAPACITY 4096
+
+
+/* grows `*array` to hold `size` items, doubling to keep appends linear */
+static bool dav_listing_reserve (void **array, size_t *capacity, size_t size, size_t item_size) {
+  if likely (size <= *capacity) {
+    return true;
+  }
+
+  size_t new_capacity = *capacity * 2;
+  if (new_capacity < size) {
+    new_capacity = size;
+  }
+  void *new_array = realloc(*array, new_capacity * item_size);
+  if unlikely (new_array == NULL) {
+    return false;
+  }
+  *array = new_array;
+  *capacity = new_capacity;
+  return true;
+}
+
+
+/* fuse_fill_dir_t appending to the listing in `buf`, stops the download
+ * once the directory is closed */
+int dav_listing_filler (
+    void *buf, const char *name, const struct stat *st, off_t off, enum fuse_fill_dir_flags flags) {
+  struct DavListing *listing = (struct DavListing *) buf;
+  int res = 0;
+
+  synchronized (mutex, &listing->lock, lock) {
+    if unlikely (listing->cancelled) {
+      res = 1;
+      break;
+    }
+
+    size_t len = strlen(name) + 1;
+    if unlikely (!dav_listing_reserve(
+          (void **) &listing->entries, &listing->capacity, listing->nentry + 1,
+          sizeof(struct DavListingEntry)) ||
+        !dav_listing_reserve(
+          (void **) &listing->names, &listing->names_capacity, listing->names_size + len, 1)) {
+      res = 1;
+      break;
+    }
+
+    memcpy(listing->names + listing->names_size, name, len);
+    listing->entries[listing->nentry++] = (struct DavListingEntry) {
+      .name = listing->names_size,
+      .st = st ? *st : (struct stat) {.st_mode = S_IFDIR},
+      .attrs = st != NULL && (flags & FUSE_FILL_DIR_PLUS),
+    };
+    listing->names_size += len;
+    pthread_cond_broadcast(&listing->cond);
+  }
+
+  return res;
+}
+
+
+void dav_listing_finish (struct DavListing *listing, int error) {
+  synchronized (mutex, &listing->lock, lock) {
+    listing->done = true;
+    listing->error = error;
+    pthread_cond_broadcast(&listing->cond);
+  }
+}
+
+
+/* Passes entries from `offset` on to filler until its buffer is full, with
+ * their attributes if `plus`. Waits for the download only if no entry could
+ * be passed yet. */
+int dav_listing_fill (
+    struct DavListing *listing, off_t offset, void *buf, fuse_fill_dir_t filler, bool plus) {
+  int res = 0;
+
+  synchronized (mutex, &listing->lock, lock) {
+    for (size_t i = offset;; i++) {
+      while (i >= listing->nentry && !listing->done && i == (size_t) offset) {
+        pthread_cond_wait(&listing->cond, &listing->lock);
+      }
+      if (i >= listing->nentry) {
+        if (i == (size_t) offset && listing->done) {
+          res = listing->error;
+        }
+        break;
+      }
+
+      const struct DavListingEntry *entry = &listing->entries[i];
+      if (plus && entry->attrs) {
+        if (filler(buf, listing->names + entry->name, &entry->st, i + 1, FUSE_FILL_DIR_PLUS)) {
+          break;
+        }
+        continue;
+      }
+      struct stat st = {.st_mode = entry->st.st_mode & S_IFMT};
+      if (filler(buf, listing->names + entry->name, &st, i + 1, 0)) {
+        break;
+      }
+    }
+  }
+
+  return res;
+}
+
+
+void dav_listing_cancel (struct DavListing *listing) {
+  synchronized (mutex, &listing->lock, lock) {
+    listing->cancelled = true;
+  }
+}
+
+
+bool dav_listing_cancelled (struct DavListing *listing) {
+  bool cancelled;
+  synchronized (mutex, &listing->lock, lock) {
+    cancelled = listing->cancelled;
+  }
+  return cancelled;
+}
+
+
+void dav_listing_release (struct DavListing *listing) {
+  unsigned int refs;
+  synchronized (mutex, &listing->lock, lock) {
+    refs = --listing->refs;
+  }
+  if (refs > 0) {
+    return;
+  }
+
+  pthread_cond_destroy(&listing->cond);
+  pthread_mutex_destroy(&listing->lock);
+  free(listing->names);
+  free(listing->entries);
+  free(listing->path);
+  free(listing);
+}
+
+
+/* new listing held by the directory and the download */
+struct DavListing *dav_listing_new (const char *path) {
+  struct DavListing *listing = calloc(1, sizeof(struct DavListing));
+  if unlikely (listing == NULL) {
+    return NULL;
+  }
+
+  listing->path = strdup(path);
+  listing->entries = malloc(DAV_LISTING_MIN_CAPACITY * sizeof(struct DavListingEntry));
+  listing->names = malloc(DAV_LISTING_MIN_NAMES_CAPACITY);
+  if unlikely (listing->path == NULL || listing->entries == NULL || listing->names == NULL) {
+    free(listing->names);
+    free(listing->entries);
+    free(listing->path);
+    free(listing);
+    return NULL;
+  }
+  listing->capacity = DAV_LISTING_MIN_CAPACITY;
+  listing->names_capacity = DAV_LISTING_MIN_NAMES_CAPACITY;
+  listing->refs = 2;
+  pthread_mutex_init(&listing->lock, NULL);
+  pthread_cond_init(&listing->cond, NULL);
+  return listing;
+}
@@ -0,0 +1,60 @@
+#ifndef PROTO_DAV_LISTING_H
+#define PROTO_DAV_LISTING_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 31
+#endif
+
+#include <fuse.h>
+
+
+/* Ordered snapshot of a directory, filled while the listing downloads.
+ * The position of an entry never changes, so it serves as the readdir
+ * offset. Shared by the open directory and the download, freed by the last
+ * of them. */
+struct DavListing {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  unsigned int refs;
+
+  char *path;
+  /* names, referenced by offset since the buffer moves when it grows */
+  char *names;
+  size_t names_size;
+  size_t names_capacity;
+  struct DavListingEntry {
+    size_t name;
+    /* only the type unless `attrs` */
+    struct stat st;
+    bool attrs;
+  } *entries;
+  size_t nentry;
+  size_t capacity;
+
+  /* the download ended, with `error` if it failed */
+  bool done;
+  int error;
+  /* the directory was closed, the download may stop */
+  bool cancelled;
+
+  /* waiting for a download worker */
+  struct DavListing *next;
+};
+
+
+int dav_listing_filler (
+  void *buf, const char *name, const struct stat *st, off_t off, enum fuse_fill_dir_flags flags);
+void dav_listing_finish (struct DavListing *listing, int error);
+int dav_listing_fill (
+  struct DavListing *listing, off_t offset, void *buf, fuse_fill_dir_t filler, bool plus);
+void dav_listing_cancel (struct DavListing *listing);
+bool dav_listing_cancelled (struct DavListing *listing);
+void dav_listing_release (struct DavListing *listing);
+struct DavListing *dav_listing_new (const char *path);
+
+
+#endif /* PROTO_DAV_LISTING_H */
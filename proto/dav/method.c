@@ -1,11 +1,11 @@
-#define _GNU_SOURCE  // tdestroy
-
-#include <search.h>
 #include <stdatomic.h>
 #include <string.h>
+#include <threads.h>
+#include <time.h>
 
 #include <utils.h>
 #include <grammar/try.h>
+#include <template/arena.h>
 #include <template/buffer.h>
 #include <wrapper/curl.h>
 #include <grammar/foreach.h>
@@ -17,80 +17,292 @@
 
 #define CONTENT_TYPE_XML "Content-Type: application/xml; charset=\"utf-8\""
 #define PREFER_MINIMAL "Prefer: return=minimal"
-#define NETWORKFS_XML_NS "NETWORKFS:"
+
+#define DAV_ARENA_BLOCK_SIZE 4096
+
+
+/* Transient strings and header lists of a request. Each thread has its own
+ * arena, and every method rewinds it to where it started before returning,
+ * so a FUSE call frees all of them at once. */
+static thread_local Arena __dav_arena = {.block_size = DAV_ARENA_BLOCK_SIZE};
+static pthread_key_t __dav_arena_key;
+static pthread_once_t __dav_arena_once = PTHREAD_ONCE_INIT;
+
+
+static void __dav_arena_destory (void *arena) {
+  Arena_destory((Arena *) arena);
+}
+
+
+static void __dav_arena_key_init (void) {
+  pthread_key_create(&__dav_arena_key, __dav_arena_destory);
+}
+
+
+static inline Arena *dav_arena (void) {
+  if unlikely (__dav_arena.block == NULL) {
+    /* free the blocks when the thread exits */
+    pthread_once(&__dav_arena_once, __dav_arena_key_init);
+    pthread_setspecific(__dav_arena_key, &__dav_arena);
+  }
+  return &__dav_arena;
+}
 
 
+enum FileLockState {
+  /* LOCK in flight, the token is not known yet */
+  FILE_LOCK_LOCKING,
+  FILE_LOCK_HELD,
+  /* UNLOCK in flight */
+  FILE_LOCK_UNLOCKING,
+  /* no longer in the map */
+  FILE_LOCK_FAILED,
+  FILE_LOCK_RELEASED,
+};
+
+
+/* A lock on a path, shared by every open of it. Only the thread that moves
+ * it into LOCKING or UNLOCKING talks to the server, and it does so without
+ * the shard lock. Everyone else waits on cond, which is only ever waited
+ * with the shard lock.
+ * With use_etag, token is the ETag the next write is conditional on, NULL
+ * if the server has not told us, and there is no LOCK or UNLOCK. */
 struct FileLock {
-  char *path;
+  HashMapEntry;
   SimpleString *token;
-  atomic_int cnt;
+  /* a PUT is waiting for its new ETag */
+  bool writing;
+  enum FileLockState state;
+  /* opens holding the lock */
+  unsigned int cnt;
+  /* one for the map and one for each waiter or refresh */
+  unsigned int refs;
+  pthread_cond_t cond;
+  /* lease, in monotonic seconds. Unused locks are kept for lock_linger
+   * seconds after the last close, and refreshed after half the lifetime the
+   * server granted, never if that is infinite */
+  time_t idle_since;
+  time_t refresh_at;
+  long lifetime;
+  /* batch of the lease keeper */
+  struct FileLock *lease_next;
+  char path[];
 };
 
 
 static inline void FileLock_destory (struct FileLock *this) {
-  free(this->path);
   delete(SimpleString) this->token;
+  pthread_cond_destroy(&this->cond);
 }
 
 GENERATE_FREE_FUNC(FileLock)
 
 
-static int __dav_strpcmp (const void *a, const void *b) {
-  return strcmp(*((const char **) a), *((const char **) b));
+static struct FileLock *FileLock_new (const char *path, size_t hash) {
+  size_t len = strlen(path);
+  struct FileLock *this = malloc(sizeof(struct FileLock) + len + 1);
+  if unlikely (this == NULL) {
+    return NULL;
+  }
+  memcpy(this->path, path, len + 1);
+  this->key = this->path;
+  this->hash = hash;
+  this->token = NULL;
+  this->writing = false;
+  this->state = FILE_LOCK_LOCKING;
+  this->cnt = 1;
+  this->refs = 1;
+  this->idle_since = 0;
+  this->refresh_at = 0;
+  this->lifetime = 0;
+  this->lease_next = NULL;
+  pthread_cond_init(&this->cond, NULL);
+  return this;
+}
+
+
+static inline time_t dav_lease_now (void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+
+/* The functions below expect the shard lock to be held. */
+
+static inline void __dav_filelock_put (struct FileLock *filelock) {
+  if (--filelock->refs == 0) {
+    delete(FileLock) filelock;
+  }
+}
+
+
+static void __dav_filelock_settle (
+    HashMapShard *shard, struct FileLock *filelock, enum FileLockState state) {
+  filelock->state = state;
+  if (state == FILE_LOCK_FAILED || state == FILE_LOCK_RELEASED) {
+    HashMapShard_remove(shard, filelock->key, filelock->hash);
+  }
+  pthread_cond_broadcast(&filelock->cond);
+  if (state == FILE_LOCK_FAILED || state == FILE_LOCK_RELEASED) {
+    __dav_filelock_put(filelock);
+  }
+}
+
+
+/* The held lock of path once no LOCK or UNLOCK of it is in flight, or NULL.
+ * failed tells whether a LOCK we waited for did not succeed. */
+static struct FileLock *__dav_filelock_find (
+    HashMapShard *shard, const char *path, size_t hash, bool *failed) {
+  while (true) {
+    struct FileLock *filelock = (struct FileLock *) HashMapShard_find(shard, path, hash);
+    if (filelock == NULL || filelock->state == FILE_LOCK_HELD) {
+      return filelock;
+    }
+
+    filelock->refs++;
+    do {
+      pthread_cond_wait(&filelock->cond, &shard->lock);
+    } while (filelock->state == FILE_LOCK_LOCKING || filelock->state == FILE_LOCK_UNLOCKING);
+    enum FileLockState state = filelock->state;
+    __dav_filelock_put(filelock);
+
+    if (state == FILE_LOCK_FAILED && failed) {
+      *failed = true;
+      return NULL;
+    }
+  }
+}
+
+
+/* whether requests carry the lock token or ETag of the paths open for
+ * writing */
+static inline bool __dav_guarded (struct DavServer *server) {
+  return server->options->use_lock || server->use_etag;
+}
+
+
+static inline char *__dav_header_if_format (
+    struct DavServer *server, Arena *arena, const SimpleString *token) {
+  return Arena_printf(arena, server->use_etag ? "If-Match: %s" : "If: (<%s>)", token->str);
 }
 
 
 static struct curl_slist *__dav_header_if (
-    struct DavServer *server, struct curl_slist *list, const char *path, enum LockType lock_type) {
-  struct FileLock **filelock_p = tfind(&path, &server->filelock_tree, __dav_strpcmp);
-  if (filelock_p) {
-    struct FileLock *filelock = *filelock_p;
-    do_once {
-      char if_header[sizeof("If: (<>)") + filelock->token->len];
-      snprintf(if_header, sizeof(if_header), "If: (<%s>)", filelock->token->str);
-      list = curl_slist_append_e(list, if_header);
-      if (list == NULL) {
+    struct DavServer *server, Arena *arena, struct curl_slist *list, const char *path,
+    enum LockType lock_type) {
+  size_t hash = HashMap_hash(path);
+  HashMapShard *shard = HashMap_shard(&server->filelocks, hash);
+  char *if_header = NULL;
+
+  synchronized (mutex, &shard->lock, lock) {
+    struct FileLock *filelock = __dav_filelock_find(shard, path, hash, NULL);
+    if (filelock == NULL || filelock->token == NULL) {
+      break;
+    }
+    if_header = __dav_header_if_format(server, arena, filelock->token);
+    if unlikely (if_header == NULL) {
+      break;
+    }
+    if (lock_type == RW_LOCK_WRITE) {
+      /* the resource goes away, and its lock with it */
+      __dav_filelock_settle(shard, filelock, FILE_LOCK_RELEASED);
+    }
+  }
+
+  if (if_header) {
+    list = curl_slist_append_arena(arena, list, if_header);
+  }
+  return list;
+}
+
+
+/* With use_etag, every PUT changes the ETag the next one has to match, so
+ * PUTs of a path go one at a time. *claimp is to be handed to
+ * __dav_etag_update with the ETag of the response. */
+static struct curl_slist *__dav_header_if_match (
+    struct DavServer *server, Arena *arena, struct curl_slist *list, const char *path,
+    struct FileLock **claimp) {
+  size_t hash = HashMap_hash(path);
+  HashMapShard *shard = HashMap_shard(&server->filelocks, hash);
+  char *if_header = NULL;
+
+  *claimp = NULL;
+  synchronized (mutex, &shard->lock, lock) {
+    struct FileLock *filelock;
+    while (true) {
+      filelock = __dav_filelock_find(shard, path, hash, NULL);
+      if (filelock == NULL || !filelock->writing) {
         break;
       }
-      if (lock_type == RW_LOCK_WRITE) {
-        tdelete(&path, &server->filelock_tree, __dav_strpcmp);
-        delete(FileLock) filelock;
-      }
+      filelock->refs++;
+      pthread_cond_wait(&filelock->cond, &shard->lock);
+      __dav_filelock_put(filelock);
+    }
+    if (filelock == NULL) {
+      break;
+    }
+
+    filelock->writing = true;
+    filelock->refs++;
+    *claimp = filelock;
+    if (filelock->token) {
+      if_header = __dav_header_if_format(server, arena, filelock->token);
     }
   }
 
+  if (if_header) {
+    list = curl_slist_append_arena(arena, list, if_header);
+  }
   return list;
 }
 
 
-int __dav_method (
-    struct DavServer *server, const char *path, const char *method, enum LockType lock_type) {
-  with_curl (curl, server->baseuh, path, server->options) {
-    if (server->options->use_lock && lock_type) {
-      switch (lock_type) {
-        case RW_LOCK_NONE:
-          break;
-        case RW_LOCK_READ:
-          while (pthread_rwlock_rdlock(&server->filelock_tree_lock));
-          break;
-        case RW_LOCK_WRITE:
-          while (pthread_rwlock_wrlock(&server->filelock_tree_lock));
-          break;
-      }
+/* etag is empty if the response had none, later writes are unconditional
+ * then. After a failed PUT the old ETag stays, and so does the conflict. */
+static void __dav_etag_update (struct DavServer *server, struct FileLock *claim, const char *etag, bool ok) {
+  HashMapShard *shard = HashMap_shard(&server->filelocks, claim->hash);
+  synchronized (mutex, &shard->lock, lock) {
+    if (ok) {
+      delete(SimpleString) claim->token;
+      claim->token = etag[0] != '\0' ? new(SimpleString) (etag) : NULL;
+    }
+    claim->writing = false;
+    pthread_cond_broadcast(&claim->cond);
+    __dav_filelock_put(claim);
+  }
+}
+
+
+static size_t __dav_etag_callback (char *buffer, size_t size, size_t nitems, void *userdata) {
+  char *etag = (char *) userdata;
+
+  if (strncasecmp(buffer, "ETag:", strlen("ETag:")) == 0) {
+    strnrstrip(buffer, nitems);
+    buffer += strlen("ETag:");
+    buffer = strlstrip(buffer);
+    /* If-Match compares strongly, a weak one never matches */
+    if (strscmp(buffer, "W/") != 0 && strlen(buffer) < DAV_CACHE_ETAG_MAX) {
+      strcpy(etag, buffer);
     }
+  }
 
-    throwable scope (curl_slist, list) {
-      if (server->options->use_lock && lock_type) {
-        throwable list = __dav_header_if(server, list, path, lock_type);
+  return nitems;
+}
+
+
+int __dav_method (
+    struct DavServer *server, const char *path, const char *method, enum LockType lock_type) {
+  Arena *arena = dav_arena();
+  with_arena_mark (arena) with_curl (curl, server->baseuh, path, server->options) {
+    throwable with (struct curl_slist *list = NULL) {
+      if (__dav_guarded(server) && lock_type) {
+        throwable list = __dav_header_if(server, arena, list, path, lock_type);
         curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
       }
       curl_easy_setopt_or_die(curl, CURLOPT_CUSTOMREQUEST, method);
       curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
-      curl_easy_perform_or_die(curl);
-    }
-
-    if (server->options->use_lock && lock_type) {
-      pthread_rwlock_unlock(&server->filelock_tree_lock);
+      curl_easy_perform_or_die(curl, CURL_CLASS_META);
     }
   }
   return TEST_SUCCESS;
@@ -121,10 +333,9 @@ int dav_head (struct DavServer *server, const char *path, size_t *sizep) {
     curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
     if (sizep) {
       *sizep = 0;
-      curl_easy_setopt(curl, CURLOPT_HEADERDATA, sizep);
-      curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, __dav_head_callback);
     }
-    curl_easy_perform_or_die(curl);
+    curl_easy_perform_idempotent_or_die(
+      curl, CURL_CLASS_META, NULL, NULL, sizep ? __dav_head_callback : NULL, sizep);
   }
   return TEST_SUCCESS;
 }
@@ -139,9 +350,7 @@ ssize_t dav_get (struct DavServer *server, const char *path, char *data, size_t
           curl_easy_setopt_or_die(curl, CURLOPT_RANGE, range);
         }
       }
-      curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buf);
-      curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, Buffer_append);
-      curl_easy_perform_or_die(curl);
+      curl_easy_perform_idempotent_or_die(curl, CURL_CLASS_DATA, Buffer_append, &buf, NULL, NULL);
     }
     res = TEST_SUCCESS == 0 ? buf.offset : -TEST_SUCCESS;
   }
@@ -149,26 +358,145 @@ ssize_t dav_get (struct DavServer *server, const char *path, char *data, size_t
 }
 
 
+/* the body comes from `reader`, which is given `reader_data`; `ranged`
+ * writes it at offset, otherwise it replaces the whole content */
+static int __dav_put (
+    struct DavServer *server, const char *path, curl_read_callback reader, void *reader_data,
+    size_t size, off_t offset, bool ranged) {
+  Arena *arena = dav_arena();
+  struct FileLock *claim = NULL;
+  char etag[DAV_CACHE_ETAG_MAX] = "";
+
+  with_arena_mark (arena) with_curl (curl, server->baseuh, path, server->options) {
+    throwable with (struct curl_slist *list = NULL) {
+      if (server->use_etag) {
+        throwable list = __dav_header_if_match(server, arena, list, path, &claim);
+      } else if (server->options->use_lock) {
+        throwable list = __dav_header_if(server, arena, list, path, RW_LOCK_READ);
+      }
+      throwable list = curl_easy_expect_common(
+        curl, arena, list, size, server->use_etag ? __dav_etag_callback : NULL, etag);
+      curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
+      curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+      curl_easy_setopt(curl, CURLOPT_READDATA, reader_data);
+      curl_easy_setopt(curl, CURLOPT_READFUNCTION, reader);
+      if (ranged) {
+        throwable with_range (range, offset, size) {
+          curl_easy_setopt_or_die(curl, CURLOPT_RANGE, range);
+        }
+      }
+      curl_easy_setopt(curl, CURLOPT_INFILESIZE, (long) size);
+      curl_easy_perform_or_die(curl, CURL_CLASS_DATA);
+    }
+  }
+
+  if (claim) {
+    __dav_etag_update(server, claim, etag, !Exception_has(&ex));
+  }
+  return TEST_SUCCESS;
+}
+
+
 int dav_put (struct DavServer *server, const char *path, const char *data, size_t size, off_t offset) {
-  with (Buffer buf, Buffer(&buf, (char *) data, size, false), Buffer_destory(&buf)) {
+  Buffer buf;
+  Buffer(&buf, (char *) data, size, false);
+  int res = __dav_put(server, path, Buffer_fetch, &buf, size, offset, true);
+  Buffer_destory(&buf);
+  return res;
+}
+
+
+int dav_put_whole (struct DavServer *server, const char *path, const char *data, size_t size) {
+  Buffer buf;
+  Buffer(&buf, (char *) data, size, false);
+  int res = __dav_put(server, path, Buffer_fetch, &buf, size, 0, false);
+  Buffer_destory(&buf);
+  return res;
+}
+
+
+static size_t __dav_zeros_read (char *buffer, size_t size, size_t nitems, void *userdata) {
+  size_t *leftp = (size_t *) userdata;
+  size_t len = size * nitems < *leftp ? size * nitems : *leftp;
+  memset(buffer, 0, len);
+  *leftp -= len;
+  return len;
+}
+
+
+int dav_put_zeros (struct DavServer *server, const char *path, off_t offset, size_t size) {
+  size_t left = size;
+  return __dav_put(server, path, __dav_zeros_read, &left, size, offset, true);
+}
+
+
+/* the part of a download to keep, in a temporary file */
+struct DavSpool {
+  FILE *file;
+  size_t left;
+};
+
+static size_t __dav_spool_write (char *buffer, size_t size, size_t nitems, void *userdata) {
+  struct DavSpool *spool = (struct DavSpool *) userdata;
+  size_t len = size * nitems;
+  /* the whole file if the server ignored the range */
+  size_t keep = len < spool->left ? len : spool->left;
+  if unlikely (fwrite(buffer, 1, keep, spool->file) != keep) {
+    return 0;
+  }
+  spool->left -= keep;
+  return len;
+}
+
+static size_t __dav_spool_read (char *buffer, size_t size, size_t nitems, void *userdata) {
+  struct DavSpool *spool = (struct DavSpool *) userdata;
+  return fread(buffer, 1, size * nitems, spool->file);
+}
+
+
+int dav_put_prefix (struct DavServer *server, const char *path, size_t size) {
+  if (size == 0) {
+    /* replacing the content keeps the properties, unlike DELETE */
+    return __dav_put(server, path, __dav_zeros_read, &size, 0, 0, false);
+  }
+
+  FILE *file = tmpfile();
+  if unlikely (file == NULL) {
+    UnspecifiedException("cannot create spool file");
+    return TEST_SUCCESS;
+  }
+
+  struct DavSpool spool = {.file = file, .left = size};
+  with_curl (curl, server->baseuh, path, server->options) {
+    throwable with_range (range, (off_t) 0, size) {
+      curl_easy_setopt_or_die(curl, CURLOPT_RANGE, range);
+    }
+    curl_easy_perform_idempotent_or_die(curl, CURL_CLASS_DATA, __dav_spool_write, &spool, NULL, NULL);
+  }
+  if likely (!Exception_has(&ex)) {
+    /* shorter than it was said to be, keep what there is */
+    size -= spool.left;
+    rewind(file);
+    __dav_put(server, path, __dav_spool_read, &spool, size, 0, false);
+  }
+
+  fclose(file);
+  return TEST_SUCCESS;
+}
+
+
+int dav_put_new (struct DavServer *server, const char *path, const char *data, size_t size) {
+  Arena *arena = dav_arena();
+  with_arena_mark (arena) with (Buffer buf, Buffer(&buf, (char *) data, size, false), Buffer_destory(&buf)) {
     throwable with_curl (curl, server->baseuh, path, server->options) {
-      throwable scope (curl_slist, list) {
-        if (server->options->use_lock) {
-          while (pthread_rwlock_rdlock(&server->filelock_tree_lock));
-          throwable list = __dav_header_if(server, list, path, 1);
-          curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
-        }
+      throwable with (struct curl_slist *list = curl_slist_append_arena(arena, NULL, "If-None-Match: *")) {
+        throwable list = curl_easy_expect_common(curl, arena, list, size, NULL, NULL);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
         curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
         curl_easy_setopt(curl, CURLOPT_READDATA, &buf);
         curl_easy_setopt(curl, CURLOPT_READFUNCTION, Buffer_fetch);
-        throwable with_range (range, offset, size) {
-          curl_easy_setopt_or_die(curl, CURLOPT_RANGE, range);
-        }
         curl_easy_setopt(curl, CURLOPT_INFILESIZE, (long) size);
-        curl_easy_perform_or_die(curl);
-        if (server->options->use_lock) {
-          pthread_rwlock_unlock(&server->filelock_tree_lock);
-        }
+        curl_easy_perform_or_die(curl, CURL_CLASS_DATA);
       }
     }
   }
@@ -177,8 +505,8 @@ int dav_put (struct DavServer *server, const char *path, const char *data, size_
 
 
 static struct curl_slist *__dav_header_destination (
-    struct DavServer *server, struct curl_slist *list, const char *path) {
-  try {
+    struct DavServer *server, Arena *arena, struct curl_slist *list, const char *path) {
+  do_once {
     throwable scope (CURLU, path_uh, server->baseuh) {
       if likely (path[0] == '/') {
         path++;
@@ -187,43 +515,38 @@ static struct curl_slist *__dav_header_destination (
       throwable with (curl_char *path_url = NULL,
                       curl_url_get_or_die(path_uh, CURLUPART_URL, &path_url, 0),
                       curl_free(path_url)) {
-        char dest_header[sizeof("Destination: ") + strlen(path_url)];
-        snprintf(dest_header, sizeof(dest_header), "Destination: %s", path_url);
-        throwable list = curl_slist_append_e(list, dest_header);
+        char *dest_header = Arena_printf(arena, "Destination: %s", path_url);
+        if unlikely (dest_header == NULL) {
+          break;
+        }
+        list = curl_slist_append_arena(arena, list, dest_header);
       }
     }
-  } onerror (e) {
-    curl_slist_free(list);
-    return NULL;
   }
   return list;
 }
 
 
 int __dav_move (struct DavServer *server, const char *from, const char *to, bool nooverwrite) {
-  with_curl (curl, server->baseuh, from, server->options) {
-    throwable scope (curl_slist, list) {
-      throwable list = __dav_header_destination(server, list, to);
+  Arena *arena = dav_arena();
+  with_arena_mark (arena) with_curl (curl, server->baseuh, from, server->options) {
+    throwable with (struct curl_slist *list = NULL) {
+      throwable list = __dav_header_destination(server, arena, list, to);
       if (nooverwrite) {
-        throwable list = curl_slist_append_e(list, "Overwrite: F");
+        throwable list = curl_slist_append_arena(arena, list, "Overwrite: F");
       }
 
+      if (__dav_guarded(server)) {
+        throwable list = __dav_header_if(server, arena, list, from, RW_LOCK_WRITE);
+      }
+      /* If-Match only speaks for the source */
       if (server->options->use_lock) {
-        while (pthread_rwlock_rdlock(&server->filelock_tree_lock));
-        if (tfind(&from, &server->filelock_tree, __dav_strpcmp)) {
-          pthread_rwlock_unlock(&server->filelock_tree_lock);
-          while (pthread_rwlock_wrlock(&server->filelock_tree_lock));
-          throwable list = __dav_header_if(server, list, from, RW_LOCK_WRITE);
-        }
-        throwable list = __dav_header_if(server, list, to, RW_LOCK_READ);
+        throwable list = __dav_header_if(server, arena, list, to, RW_LOCK_READ);
       }
       curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
       curl_easy_setopt_or_die(curl, CURLOPT_CUSTOMREQUEST, "MOVE");
       curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
-      curl_easy_perform_or_die(curl);
-      if (server->options->use_lock) {
-        pthread_rwlock_unlock(&server->filelock_tree_lock);
-      }
+      curl_easy_perform_or_die(curl, CURL_CLASS_META);
     }
   }
   return TEST_SUCCESS;
@@ -235,240 +558,462 @@ extern inline int dav_move_nooverwrite (struct DavServer *server, const char *fr
 
 
 int dav_copy (struct DavServer *server, const char *from, const char *to) {
-  with_curl (curl, server->baseuh, from, server->options) {
-    throwable scope (curl_slist, list) {
-      throwable list = __dav_header_destination(server, list, to);
+  Arena *arena = dav_arena();
+  with_arena_mark (arena) with_curl (curl, server->baseuh, from, server->options) {
+    throwable with (struct curl_slist *list = NULL) {
+      throwable list = __dav_header_destination(server, arena, list, to);
       if (server->options->use_lock) {
-        while (pthread_rwlock_rdlock(&server->filelock_tree_lock));
-        throwable list = __dav_header_if(server, list, to, RW_LOCK_READ);
+        throwable list = __dav_header_if(server, arena, list, to, RW_LOCK_READ);
       }
       curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
       curl_easy_setopt_or_die(curl, CURLOPT_CUSTOMREQUEST, "COPY");
       curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
-      curl_easy_perform_or_die(curl);
-      if (server->options->use_lock) {
-        pthread_rwlock_unlock(&server->filelock_tree_lock);
+      curl_easy_perform_or_die(curl, CURL_CLASS_DATA);
+    }
+  }
+  return TEST_SUCCESS;
+}
+
+
+#define DAV_PROPFIND_BODY(props) "<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n" \
+  "<D:propfind xmlns:D=\"DAV:\" xmlns:N=\"" NETWORKFS_XML_NS "\">\r\n" \
+    "<D:prop>\r\n" props "\r\n</D:prop>\r\n" \
+  "</D:propfind>\r\n"
+/* readdir passes on little more than the type, getattr wants the times and
+ * the ETag an open for writing is about to need */
+#define DAV_PROPFIND_LISTING \
+  "<D:resourcetype/><D:getlastmodified/><D:getcontentlength/>"
+#define DAV_PROPFIND_STAT DAV_PROPFIND_LISTING "<D:creationdate/><D:getetag/>"
+#define DAV_PROPFIND_DEAD "<N:mode/><N:size/><N:owner/><N:time/><N:target/>"
+
+/* listing responses without any dead property before listings no longer
+ * ask for them */
+#define DAV_DEAD_PROPS_PROBE 64
+
+
+struct DavPropfindContext {
+  struct DavServer *server;
+  Arena *arena;
+  const char *path;
+  void *buf;
+  fuse_fill_dir_t filler;
+  /* listed without the dead properties, the attributes may be incomplete */
+  bool lean;
+  /* responses so far, and whether one had a dead property */
+  unsigned int nresponse;
+  bool seen;
+  /* request URL and its path part without trailing slash, hrefs come in
+   * either form */
+  curl_char *encoded_baseurl;
+  curl_char *encoded_basepath;
+};
+
+
+static inline int __dav_hexdigit (char c) {
+  if ((unsigned int) c - '0' <= 9) {
+    return c - '0';
+  }
+  c |= 0x20;
+  if ((unsigned int) c - 'a' <= 5) {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+
+/* percent-decodes the first path segment of `encoded` into the arena,
+ * up to an encoded slash as well */
+static char *__dav_unescape_segment (Arena *arena, const char *encoded) {
+  size_t len = strcspn(encoded, "/");
+  char *ret = Arena_alloc(arena, len + 1);
+  if unlikely (ret == NULL) {
+    return NULL;
+  }
+
+  char *out = ret;
+  for (size_t i = 0; i < len; i++) {
+    int high, low;
+    if (encoded[i] == '%' && i + 2 < len &&
+        (high = __dav_hexdigit(encoded[i + 1])) >= 0 &&
+        (low = __dav_hexdigit(encoded[i + 2])) >= 0) {
+      if unlikely ((high << 4 | low) == '/') {
+        break;
+      }
+      *out++ = high << 4 | low;
+      i += 2;
+    } else {
+      *out++ = encoded[i];
+    }
+  }
+  *out = '\0';
+  return ret;
+}
+
+
+static inline void __dav_strip_slash (char *s) {
+  for (size_t len = strlen(s); len > 0 && s[len - 1] == '/'; len--) {
+    s[len - 1] = '\0';
+  }
+}
+
+
+static int __dav_propfind_base (struct DavServer *server, const char *path, struct DavPropfindContext *context) {
+  do_once {
+    throwable scope (CURLU, path_uh, server->baseuh) {
+      if likely (path[0] == '/') {
+        path++;
+      }
+      if likely (path[0] != '\0') {
+        curl_url_set_or_die(path_uh, CURLUPART_URL, path, CURLU_URLENCODE);
       }
+      curl_url_get_or_die(path_uh, CURLUPART_URL, &context->encoded_baseurl, 0);
+      curl_url_get_or_die(path_uh, CURLUPART_PATH, &context->encoded_basepath, 0);
     }
+    __dav_strip_slash(context->encoded_baseurl);
+    __dav_strip_slash(context->encoded_basepath);
   }
   return TEST_SUCCESS;
 }
 
 
-int dav_propfind (struct DavServer *server, const char *path, int depth, void *buf, fuse_fill_dir_t filler) {
-#if 1
-  static const char propfind_body[] = "<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
-  "<D:propfind xmlns:D=\"DAV:\" xmlns:N=\"" NETWORKFS_XML_NS "\">\r\n"
-    "<D:prop>\r\n"
-      "<D:resourcetype/>"
-      "<D:creationdate/>"
-      "<D:getlastmodified/>"
-      "<D:getcontentlength/>"
-      "<N:mode/>"
-      "<N:size/>"
-      "<N:owner/>"
-      "<N:time/>\r\n"
-    "</D:prop>\r\n"
-  "</D:propfind>\r\n";
-#endif
+/* whether a response carried any of the dead properties, the first one
+ * seen brings them back to listings */
+static bool __dav_dead_props_seen (struct DavServer *server, const struct DavResponse *response) {
+  for (int i = 0; i < DAV_PROP_MAX; i++) {
+    if ((DAV_PROPS_NETWORKFS & 1U << i) && response->props[i].value) {
+      atomic_store_explicit(&server->dead_props_misses, 0, memory_order_relaxed);
+      if unlikely (atomic_load_explicit(&server->dead_props, memory_order_relaxed) != DAV_DEAD_PROPS_PRESENT) {
+        atomic_store(&server->dead_props, DAV_DEAD_PROPS_PRESENT);
+      }
+      return true;
+    }
+  }
+  return false;
+}
 
-#if 1
-  with (Buffer propfind_buf,
-        Buffer(&propfind_buf, (char *) propfind_body, strlen(propfind_body), false),
-        Buffer_destory(&propfind_buf)) {
-#endif
-    with (xmlParserCtxtPtr ctxt = NULL,
-          if (ctxt) xmlFreeDoc(ctxt->myDoc); xmlFreeParserCtxt(ctxt)) {
-      throwable with_curl (curl, server->baseuh, path, server->options) {
-        char depth_header[32];
-        snprintf(depth_header, sizeof(depth_header), "Depth: %d", depth);
-        throwable scope (curl_slist, list, depth_header) {
-          list = curl_slist_append_weak(list, PREFER_MINIMAL);
-          list = curl_slist_append_weak(list, CONTENT_TYPE_XML);
-          curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
-        #if 1
-          curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
-          curl_easy_setopt(curl, CURLOPT_READDATA, &propfind_buf);
-          curl_easy_setopt(curl, CURLOPT_READFUNCTION, Buffer_fetch);
-          curl_easy_setopt(curl, CURLOPT_INFILESIZE, (long) propfind_buf.size);
-        #endif
-          curl_easy_setopt(curl, CURLOPT_WRITEDATA, &ctxt);
-          curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_parse_xml);
-          curl_easy_setopt_or_die(curl, CURLOPT_CUSTOMREQUEST, "PROPFIND");
-          curl_easy_perform_or_die(curl);
-        }
 
-        xmlParseChunk(ctxt, NULL, 0, 1);
+/* Listings stop asking for the dead properties once DAV_DEAD_PROPS_PROBE
+ * responses of listings without any one of them came in. A listing with
+ * one resets the count, a mixed directory keeps asking. */
+static void __dav_dead_props_missed (struct DavServer *server, unsigned int nresponse) {
+  unsigned int misses = atomic_fetch_add_explicit(&server->dead_props_misses, nresponse, memory_order_relaxed);
+  if (misses < DAV_DEAD_PROPS_PROBE && misses + nresponse >= DAV_DEAD_PROPS_PROBE) {
+    atomic_store(&server->dead_props, DAV_DEAD_PROPS_ABSENT);
+  }
+}
 
-        long response_code;
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-        if unlikely (response_code != 207) {
-          break;
-        }
 
-        auto doc = ctxt->myDoc;
-        condition_throw(ctxt->wellFormed) UnspecifiedException("Failed to parse");
+static int __dav_propfind_response (void *data, const struct DavResponse *response) {
+  struct DavPropfindContext *context = (struct DavPropfindContext *) data;
+  struct DavServer *server = context->server;
 
-        const char *encoded_baseurl;
-        curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &encoded_baseurl);
+  if (!context->lean) {
+    context->nresponse++;
+    if (!context->seen) {
+      context->seen = __dav_dead_props_seen(server, response);
+    }
+  }
 
-        foreach(Node) (response, xmlDocGetRootElement(doc)) {
-          if (xmlStrcmp(response->name, BAD_CAST "response") != 0) {
-            continue;
-          }
+  struct stat st = {
+    .st_uid = server->options->uid,
+    .st_gid = server->options->gid,
+    .st_mode = (S_IFREG | 0777) & ~server->options->fmask,
+    .st_nlink = 1
+  };
 
-          xmlNodePtr href = NULL;
-          xmlNodePtr propstat = NULL;
-          xmlNodePtr prop = NULL;
-          xmlNodePtr status = NULL;
-          foreach(Node) (response_node, response) {
-            if (href == NULL) {
-              if (xmlStrcmp(response_node->name, BAD_CAST "href") == 0) {
-                href = response_node;
-              }
-            } else if (propstat == NULL) {
-              if (xmlStrcmp(response_node->name, BAD_CAST "propstat") != 0) {
-                continue;
-              }
-              propstat = response_node;
-              foreach(Node) (propstat_node, propstat) {
-                if (prop == NULL) {
-                  if (xmlStrcmp(propstat_node->name, BAD_CAST "prop") == 0) {
-                    prop = propstat_node;
-                  }
-                } else if (status == NULL) {
-                  if (xmlStrcmp(propstat_node->name, BAD_CAST "status") == 0) {
-                    status = propstat_node;
-                  }
-                } else {
-                  break;
-                }
-              }
-              if (status->children == NULL ||
-                  xmlStrcmp(status->children->content, BAD_CAST "HTTP/1.1 200 OK") != 0) {
-                // debug
-                propstat = NULL;
-                prop = NULL;
-                status = NULL;
-              }
-            } else {
-              break;
-            }
-          }
-          condition_throw(href && propstat && prop && status) UnspecifiedException("response unexpected");
-
-          struct stat st = {
-            .st_uid = server->options->uid,
-            .st_gid = server->options->gid,
-            .st_mode = (S_IFREG | 0777) & ~server->options->fmask,
-            .st_nlink = 1
-          };
-
-          foreach(Node) (prop_entry, prop) {
-            if (xmlStrcmp(prop_entry->ns->href, BAD_CAST "DAV:") != 0) {
-              continue;
-            }
+  const struct DavProp *props = response->props;
+  const struct DavProp *prop;
 
-            if (xmlStrcmp(prop_entry->name, BAD_CAST "getcontentlength") == 0) {
-              st.st_size = strtol((const char *) prop_entry->children->content, NULL, 10);
-            } else if (xmlStrcmp(prop_entry->name, BAD_CAST "resourcetype") == 0) {
-              if (prop_entry->children && prop_entry->children->name &&
-                  xmlStrcmp(prop_entry->children->name, BAD_CAST "collection") == 0) {
-                st.st_mode = (S_IFDIR | 0777) & ~server->options->dmask;
-                st.st_nlink = 2;
-              }
-            } else if (xmlStrcmp(prop_entry->name, BAD_CAST "creationdate") == 0) {
-              st.st_ctime = xmlParserTimeNode(prop_entry);
-            } else if (xmlStrcmp(prop_entry->name, BAD_CAST "getlastmodified") == 0) {
-              st.st_mtime = xmlParserTimeNode(prop_entry);
-            }
-          }
+  if ((prop = &props[DAV_PROP_DAV_getcontentlength])->value) {
+    st.st_size = strtol(prop->value, NULL, 10);
+  }
+  if ((prop = &props[DAV_PROP_DAV_resourcetype])->value) {
+    if (prop->child && strcmp(prop->child, "collection") == 0) {
+      st.st_mode = (S_IFDIR | 0777) & ~server->options->dmask;
+      st.st_nlink = 2;
+    }
+  }
+  if ((prop = &props[DAV_PROP_DAV_creationdate])->value) {
+    st.st_ctime = xmlParserTime(prop->value, prop->dt);
+  }
+  if ((prop = &props[DAV_PROP_DAV_getlastmodified])->value) {
+    st.st_mtime = xmlParserTime(prop->value, prop->dt);
+  }
 
-          foreach(Node) (prop_entry, prop) {
-            if (xmlStrcmp(prop_entry->ns->href, BAD_CAST NETWORKFS_XML_NS) != 0) {
-              continue;
-            }
+  /* NETWORKFS: properties override the DAV: ones */
+  if ((prop = &props[DAV_PROP_NETWORKFS_mode])->value) {
+    char *rdev;
+    st.st_mode = strtol(prop->value, &rdev, 8);
+    if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode)) {
+      st.st_rdev = strtol(rdev, NULL, 10);
+    }
+  }
+  if ((prop = &props[DAV_PROP_NETWORKFS_size])->value) {
+    st.st_size = strtol(prop->value, NULL, 10);
+  }
+  if ((prop = &props[DAV_PROP_NETWORKFS_owner])->value) {
+    char *gid;
+    st.st_uid = strtol(prop->value, &gid, 10);
+    /* written as "uid:gid" */
+    st.st_gid = strtol(gid + (*gid == ':'), NULL, 10);
+  }
+  if ((prop = &props[DAV_PROP_NETWORKFS_time])->value) {
+    char *end;
+    st.st_ctime = strtol(prop->value, &end, 10);
+    st.st_mtime = strtol(end, &end, 10);
+    st.st_atime = strtol(end, NULL, 10);
+  }
 
-            if (xmlStrcmp(prop_entry->name, BAD_CAST "mode") == 0) {
-              char *rdev;
-              st.st_mode = strtol((const char *) prop_entry->children->content, &rdev, 8);
-              if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode)) {
-                st.st_rdev = strtol(rdev, NULL, 10);
-              }
-            } else if (xmlStrcmp(prop_entry->name, BAD_CAST "size") == 0) {
-              st.st_size = strtol((const char *) prop_entry->children->content, NULL, 10);
-            } else if (xmlStrcmp(prop_entry->name, BAD_CAST "owner") == 0) {
-              char *gid;
-              st.st_uid = strtol((const char *) prop_entry->children->content, &gid, 10);
-              st.st_gid = strtol(gid, NULL, 10);
-            } else if (xmlStrcmp(prop_entry->name, BAD_CAST "time") == 0) {
-              char *end;
-              st.st_ctime = strtol((const char *) prop_entry->children->content, &end, 10);
-              st.st_mtime = strtol(end, &end, 10);
-              st.st_atime = strtol(end, NULL, 10);
-            }
-          }
+  const char *encoded_name;
+  if (strscmp(response->href, context->encoded_baseurl) == 0) {
+    encoded_name = response->href + strlen(context->encoded_baseurl);
+  } else if (strscmp(response->href, context->encoded_basepath) == 0) {
+    encoded_name = response->href + strlen(context->encoded_basepath);
+  } else {
+    encoded_name = NULL;
+  }
+  if (encoded_name == NULL || (encoded_name[0] != '\0' && encoded_name[0] != '/')) {
+    return 0;
+  }
+  while (encoded_name[0] == '/') {
+    encoded_name++;
+  }
 
-          const char *encoded_fullurl = (const char *) href->children->content;
-          if (strscmp(encoded_fullurl, encoded_baseurl) != 0) {
-            //debug
-            printf("missing: %s, want %s\n", encoded_fullurl, encoded_baseurl);
-            continue;
-          }
+  int res = 0;
+  with_arena_mark (context->arena) {
+    char *filename = __dav_unescape_segment(context->arena, encoded_name);
+    if unlikely (filename == NULL) {
+      break;
+    }
+    if (context->lean) {
+      /* a mode or owner of ours may be missing, only the type is passed on
+       * and getattr asks again */
+      res = context->filler(context->buf, filename[0] == '\0' ? "." : filename, &st, 0, 0);
+      break;
+    }
+    dav_cache_put_child(
+      &server->cache, context->path, filename, &st, props[DAV_PROP_DAV_getetag].value,
+      S_ISLNK(st.st_mode) ? props[DAV_PROP_NETWORKFS_target].value : NULL);
+    res = context->filler(context->buf, filename[0] == '\0' ? "." : filename, &st, 0, FUSE_FILL_DIR_PLUS);
+  }
+  return res;
+}
 
-          throwable with (auto filename = curl_easy_unescape_e(NULL, encoded_fullurl + strlen(encoded_baseurl), 0, NULL),
-                          curl_free(filename)) {
-            auto dirslash = strchr(filename, '/');
-            if (dirslash) {
-              *dirslash = '\0';
-            }
-            filler(buf, filename[0] == '\0' ? "." : filename, &st, 0, 0);
-          }
+
+int dav_propfind (struct DavServer *server, const char *path, int depth, void *buf, fuse_fill_dir_t filler) {
+#if 1
+  /* getattr always asks for the dead properties, so a file carrying them
+   * brings them back to listings */
+  static const char propfind_stat[] = DAV_PROPFIND_BODY(DAV_PROPFIND_STAT DAV_PROPFIND_DEAD);
+  static const char propfind_listing[] = DAV_PROPFIND_BODY(DAV_PROPFIND_LISTING DAV_PROPFIND_DEAD);
+  static const char propfind_listing_lean[] = DAV_PROPFIND_BODY(DAV_PROPFIND_LISTING);
+  bool lean = depth > 0 &&
+    atomic_load_explicit(&server->dead_props, memory_order_relaxed) == DAV_DEAD_PROPS_ABSENT;
+  const char *propfind_body = depth == 0 ? propfind_stat : lean ? propfind_listing_lean : propfind_listing;
+#endif
+
+  Arena *arena = dav_arena();
+  struct DavPropfindContext context = {
+    .server = server,
+    .arena = arena,
+    .path = path,
+    .buf = buf,
+    .filler = filler,
+    .lean = lean,
+  };
+
+  /* responses reach filler while the body is still arriving, the transfer
+   * is aborted if filler asks to stop */
+  with_arena_mark (arena)
+  with (DavMultistatus parser, DavMultistatus(&parser, __dav_propfind_response, &context),
+        DavMultistatus_destory(&parser)) {
+    throwable __dav_propfind_base(server, path, &context);
+    throwable with_curl (curl, server->baseuh, path, server->options) {
+      char depth_header[32];
+      snprintf(depth_header, sizeof(depth_header), "Depth: %d", depth);
+      throwable with (struct curl_slist *list = curl_slist_append_arena(arena, NULL, depth_header)) {
+        list = curl_slist_append_arena(arena, list, PREFER_MINIMAL);
+        list = curl_slist_append_arena(arena, list, CONTENT_TYPE_XML);
+        throwable list = curl_slist_append_arena(arena, list, CURL_HEADER_NO_EXPECT);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
+      #if 1
+        /* inline body, so a hedged duplicate can send it again */
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, propfind_body);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long) strlen(propfind_body));
+      #endif
+        curl_easy_setopt_or_die(curl, CURLOPT_CUSTOMREQUEST, "PROPFIND");
+        CURLcode res = curl_easy_perform_idempotent(
+          &curl, CURL_CLASS_META, curl_parse_multistatus, &parser, NULL, NULL);
+        if unlikely (parser.stopped) {
+          /* by filler, or its exception is the one to report */
+          break;
         }
+        curl_do_or_die(res, CURL_PERFORM, curl);
+      }
+      if unlikely (parser.stopped) {
+        break;
+      }
+
+      long response_code;
+      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+      if unlikely (response_code != 207) {
+        break;
+      }
+
+      condition_throw(DavMultistatus_finish(&parser)) UnspecifiedException("Failed to parse");
+      if (depth > 0 && !lean && !context.seen) {
+        __dav_dead_props_missed(server, context.nresponse);
       }
     }
-#if 1
   }
-#endif
 
+  curl_free(context.encoded_baseurl);
+  curl_free(context.encoded_basepath);
   return TEST_SUCCESS;
 }
 
 
-int dav_proppatch (struct DavServer *server, const char *path, const char *key, const char *value) {
-  static const char proppatch_body_template[] = "<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
-  "<D:propertyupdate xmlns:D=\"DAV:\" xmlns:N=\"" NETWORKFS_XML_NS "\">\r\n"
-    "<D:%s>\r\n"           //     set                remove
-      "<D:prop>"  // no newline here!
-        "<%s>%s</%s>\r\n"  // <N:key>value</N:key>  <N:key/>
-      "</D:prop>\r\n"
-    "</D:%s>\r\n"
-  "</D:propertyupdate>\r\n";
-
-  char proppatch_body[
-    sizeof(proppatch_body_template) - 2 * 5 + strlen("remove") * 2 +
-    strlen(key) * 2 + (value ? strlen(value) : 0)];
-  snprintf(
-    proppatch_body, sizeof(proppatch_body), proppatch_body_template,
-    value ? "set" : "remove", key, value ? value : "", key, value ? "set" : "remove"
-  );
-  with (Buffer buf, Buffer(&buf, (char *) proppatch_body, strlen(proppatch_body), false), Buffer_destory(&buf)) {
-    throwable with_curl (curl, server->baseuh, path, server->options) {
-      throwable scope (curl_slist, list, CONTENT_TYPE_XML) {
-        list = curl_slist_append_weak(list, PREFER_MINIMAL);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
-        curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
-        curl_easy_setopt(curl, CURLOPT_READDATA, &buf);
-        curl_easy_setopt(curl, CURLOPT_READFUNCTION, Buffer_fetch);
-        curl_easy_setopt(curl, CURLOPT_INFILESIZE, (long) buf.size);
-        curl_easy_setopt_or_die(curl, CURLOPT_CUSTOMREQUEST, "PROPPATCH");
-        curl_easy_perform_or_die(curl);
+static size_t __dav_discard (char *buffer, size_t size, size_t nitems, void *userdata) {
+  return size * nitems;
+}
+
+
+/* text content with the XML special characters escaped, `s` itself if it
+ * has none */
+static const char *__dav_xml_escape (Arena *arena, const char *s) {
+  size_t extra = 0;
+  for (const char *p = s; *p != '\0'; p++) {
+    switch (*p) {
+      case '&': extra += strlen("&amp;") - 1; break;
+      case '<': extra += strlen("&lt;") - 1; break;
+      case '>': extra += strlen("&gt;") - 1; break;
+    }
+  }
+  if likely (extra == 0) {
+    return s;
+  }
+
+  char *ret = Arena_alloc(arena, strlen(s) + extra + 1);
+  if unlikely (ret == NULL) {
+    return NULL;
+  }
+  char *out = ret;
+  for (const char *p = s; *p != '\0'; p++) {
+    switch (*p) {
+      case '&': out = stpcpy(out, "&amp;"); break;
+      case '<': out = stpcpy(out, "&lt;"); break;
+      case '>': out = stpcpy(out, "&gt;"); break;
+      default: *out++ = *p; break;
+    }
+  }
+  *out = '\0';
+  return ret;
+}
+
+
+static int __dav_proppatch_response (void *data, const struct DavResponse *response) {
+  return 0;
+}
+
+
+/* stop asking PROPFIND for properties the server will not keep */
+static void __dav_dead_props_refused (struct DavServer *server) {
+  if (atomic_exchange(&server->dead_props, DAV_DEAD_PROPS_ABSENT) != DAV_DEAD_PROPS_ABSENT) {
+    fputs("Server refused the dead properties, no longer asking for them\n", stderr);
+  }
+}
+
+
+int dav_proppatch_n (struct DavServer *server, const char *path, const struct DavPropUpdate *props, size_t n) {
+  static const char proppatch_body_head[] = "<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
+  "<D:propertyupdate xmlns:D=\"DAV:\" xmlns:N=\"" NETWORKFS_XML_NS "\">\r\n";
+  static const char proppatch_body_tail[] = "</D:propertyupdate>\r\n";
+  // no newline inside D:prop!
+  static const char proppatch_set_template[] = "<D:set><D:prop><%s>%s</%s></D:prop></D:set>\r\n";
+  static const char proppatch_remove_template[] = "<D:remove><D:prop><%s/></D:prop></D:remove>\r\n";
+
+  Arena *arena = dav_arena();
+  with_arena_mark (arena) do_once {
+    const char *values[n];
+    bool dead = false;
+    size_t body_size = sizeof(proppatch_body_head) + sizeof(proppatch_body_tail);
+    for (size_t i = 0; i < n; i++) {
+      if (props[i].value) {
+        throwable values[i] = __dav_xml_escape(arena, props[i].value);
+        body_size += sizeof(proppatch_set_template) + strlen(props[i].key) * 2 + strlen(values[i]);
+      } else {
+        values[i] = NULL;
+        body_size += sizeof(proppatch_remove_template) + strlen(props[i].key);
+      }
+      if (strscmp(props[i].key, "N:") == 0) {
+        dead = true;
+      }
+    }
+    check;
+
+    char *proppatch_body;
+    throwable proppatch_body = Arena_alloc(arena, body_size);
+    char *out = stpcpy(proppatch_body, proppatch_body_head);
+    for (size_t i = 0; i < n; i++) {
+      if (values[i]) {
+        out += sprintf(out, proppatch_set_template, props[i].key, values[i], props[i].key);
+      } else {
+        out += sprintf(out, proppatch_remove_template, props[i].key);
+      }
+    }
+    strcpy(out, proppatch_body_tail);
+
+    /* a 207 may still refuse some of the properties, it is read for the
+     * verdict on the dead ones */
+    with (DavMultistatus parser, DavMultistatus(&parser, __dav_proppatch_response, NULL),
+          DavMultistatus_destory(&parser)) {
+      throwable with_curl (curl, server->baseuh, path, server->options) {
+        throwable with (struct curl_slist *list = curl_slist_append_arena(arena, NULL, CONTENT_TYPE_XML)) {
+          list = curl_slist_append_arena(arena, list, PREFER_MINIMAL);
+          throwable list = curl_slist_append_arena(arena, list, CURL_HEADER_NO_EXPECT);
+          if (__dav_guarded(server)) {
+            throwable list = __dav_header_if(server, arena, list, path, RW_LOCK_READ);
+          }
+          curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
+          curl_easy_setopt(curl, CURLOPT_POSTFIELDS, proppatch_body);
+          curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long) strlen(proppatch_body));
+          curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_parse_multistatus);
+          curl_easy_setopt(curl, CURLOPT_WRITEDATA, &parser);
+          curl_easy_setopt_or_die(curl, CURLOPT_CUSTOMREQUEST, "PROPPATCH");
+          CURLcode res = curl_easy_perform_common(curl, CURL_CLASS_META);
+          if (dead && res == CURLE_HTTP_RETURNED_ERROR) {
+            long response_code = 0;
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+            if (response_code == 405 || response_code == 501) {
+              /* no PROPPATCH at all, so no dead properties either */
+              __dav_dead_props_refused(server);
+            }
+          }
+          curl_do_or_die(res, CURL_PERFORM, curl);
+        }
+        if (!dead) {
+          break;
+        }
+
+        long response_code;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+        if (response_code == 207 && DavMultistatus_finish(&parser) &&
+            (parser.refused & DAV_PROPS_NETWORKFS)) {
+          /* the live properties still tell the basics */
+          __dav_dead_props_refused(server);
+        } else {
+          /* the server has them from now on */
+          atomic_store_explicit(&server->dead_props_misses, 0, memory_order_relaxed);
+          atomic_store(&server->dead_props, DAV_DEAD_PROPS_PRESENT);
+        }
       }
     }
   }
   return TEST_SUCCESS;
 }
 
+extern inline int dav_proppatch (struct DavServer *server, const char *path, const char *key, const char *value);
+
 
 static size_t __dav_lock_callback (char *buffer, size_t size, size_t nitems, void *userdata) {
   SimpleString **res_p = (SimpleString **) userdata;
@@ -491,7 +1036,8 @@ static size_t __dav_lock_callback (char *buffer, size_t size, size_t nitems, voi
 }
 
 
-static SimpleString *__dav_lock (struct DavServer *server, const char *path) {
+/* timeoutp receives the lifetime the server granted, 0 for infinite */
+static SimpleString *__dav_lock (struct DavServer *server, const char *path, long *timeoutp) {
   static const char lock_body[] = "<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
   "<D:lockinfo xmlns:D=\"DAV:\">\r\n"
     "<D:lockscope><D:exclusive/></D:lockscope>\r\n"
@@ -502,90 +1048,101 @@ static SimpleString *__dav_lock (struct DavServer *server, const char *path) {
   "</D:lockinfo>\r\n";
 
   SimpleString *token = NULL;
-
-  try {
-    with (Buffer buf, Buffer(&buf, (char *) lock_body, strlen(lock_body), false), Buffer_destory(&buf)) {
-    #if 1
-      throwable with (xmlParserCtxtPtr ctxt = NULL,
-                      if (ctxt) xmlFreeDoc(ctxt->myDoc); xmlFreeParserCtxt(ctxt)) {
-    #endif
-        throwable with_curl (curl, server->baseuh, path, server->options) {
-          //throwable scope (curl_slist, list, "Timeout: Infinite, Second-4100000000") {
-          throwable scope (curl_slist, list, "Timeout: Second-600") {
-            list = curl_slist_append_weak(list, CONTENT_TYPE_XML);
-            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
-            curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
-            curl_easy_setopt(curl, CURLOPT_HEADERDATA, &token);
-            curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, __dav_lock_callback);
-          #if 1
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &ctxt);
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_parse_xml);
-          #else
-            curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
-          #endif
-            curl_easy_setopt(curl, CURLOPT_READDATA, &buf);
-            curl_easy_setopt(curl, CURLOPT_READFUNCTION, Buffer_fetch);
-            curl_easy_setopt(curl, CURLOPT_INFILESIZE, (long) buf.size);
-            curl_easy_setopt_or_die(curl, CURLOPT_CUSTOMREQUEST, "LOCK");
-            curl_easy_perform_or_die(curl);
-          }
+  Arena *arena = dav_arena();
+  *timeoutp = server->options->lock_timeout;
+
+  with_arena_mark (arena) try {
+    char *timeout_header = Arena_printf(
+      arena, "Timeout: Second-%ld", server->options->lock_timeout);
+    check;
+  #if 1
+    throwable with (xmlParserCtxtPtr ctxt = NULL,
+                    if (ctxt) xmlFreeDoc(ctxt->myDoc); xmlFreeParserCtxt(ctxt)) {
+  #endif
+      throwable with_curl (curl, server->baseuh, path, server->options) {
+        //throwable scope (curl_slist, list, "Timeout: Infinite, Second-4100000000") {
+        throwable with (struct curl_slist *list = curl_slist_append_arena(arena, NULL, timeout_header)) {
+          list = curl_slist_append_arena(arena, list, CONTENT_TYPE_XML);
+          throwable list = curl_slist_append_arena(arena, list, CURL_HEADER_NO_EXPECT);
+          curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
+          curl_easy_setopt(curl, CURLOPT_HEADERDATA, &token);
+          curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, __dav_lock_callback);
+        #if 1
+          curl_easy_setopt(curl, CURLOPT_WRITEDATA, &ctxt);
+          curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_parse_xml);
+        #else
+          curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+        #endif
+          curl_easy_setopt(curl, CURLOPT_POSTFIELDS, lock_body);
+          curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long) sizeof(lock_body) - 1);
+          curl_easy_setopt_or_die(curl, CURLOPT_CUSTOMREQUEST, "LOCK");
+          curl_easy_perform_or_die(curl, CURL_CLASS_META);
         }
+      }
 
-        condition_throw(token) UnspecifiedException("LOCK doesn't return a token");
+      condition_throw(token) UnspecifiedException("LOCK doesn't return a token");
 
-      #if 1
-        xmlParseChunk(ctxt, NULL, 0, 1);
+    #if 1
+      xmlParseChunk(ctxt, NULL, 0, 1);
 
-        auto doc = ctxt->myDoc;
-        condition_throw(ctxt->wellFormed) UnspecifiedException("Failed to parse");
+      auto doc = ctxt->myDoc;
+      condition_throw(ctxt->wellFormed) UnspecifiedException("Failed to parse");
 
-        foreach(Node) (lockdiscovery, xmlDocGetRootElement(doc)) {
-          if (xmlStrcmp(lockdiscovery->name, BAD_CAST "lockdiscovery") != 0) {
-            continue;
-          }
+      foreach(Node) (lockdiscovery, xmlDocGetRootElement(doc)) {
+        if (xmlStrcmp(lockdiscovery->name, BAD_CAST "lockdiscovery") != 0) {
+          continue;
+        }
 
-          xmlNodePtr activelock = NULL;
-          xmlNodePtr timeout = NULL;
-          xmlNodePtr locktoken = NULL;
-          xmlNodePtr href = NULL;
-          foreach(Node) (lockdiscovery_node, lockdiscovery) {
-            if (xmlStrcmp(lockdiscovery_node->name, BAD_CAST "activelock") == 0) {
-              activelock = lockdiscovery_node;
-              foreach(Node) (activelock_node, activelock) {
-                if (timeout == NULL) {
-                  if (xmlStrcmp(activelock_node->name, BAD_CAST "timeout") == 0) {
-                    timeout = activelock_node;
-                  }
-                } else if (locktoken == NULL) {
-                  if (xmlStrcmp(activelock_node->name, BAD_CAST "locktoken") == 0) {
-                    locktoken = activelock_node;
-                    foreach(Node) (locktoken_node, locktoken) {
-                      if (xmlStrcmp(locktoken_node->name, BAD_CAST "href") == 0) {
-                        href = locktoken_node;
-                        break;
-                      }
+        xmlNodePtr activelock = NULL;
+        xmlNodePtr timeout = NULL;
+        xmlNodePtr locktoken = NULL;
+        xmlNodePtr href = NULL;
+        foreach(Node) (lockdiscovery_node, lockdiscovery) {
+          if (xmlStrcmp(lockdiscovery_node->name, BAD_CAST "activelock") == 0) {
+            activelock = lockdiscovery_node;
+            foreach(Node) (activelock_node, activelock) {
+              if (timeout == NULL) {
+                if (xmlStrcmp(activelock_node->name, BAD_CAST "timeout") == 0) {
+                  timeout = activelock_node;
+                }
+              } else if (locktoken == NULL) {
+                if (xmlStrcmp(activelock_node->name, BAD_CAST "locktoken") == 0) {
+                  locktoken = activelock_node;
+                  foreach(Node) (locktoken_node, locktoken) {
+                    if (xmlStrcmp(locktoken_node->name, BAD_CAST "href") == 0) {
+                      href = locktoken_node;
+                      break;
                     }
                   }
-                } else {
-                  break;
                 }
+              } else {
+                break;
               }
             }
-            break;
           }
-          condition_throw(
-            activelock && timeout && locktoken && href
-          ) UnspecifiedException("prop unexpected");
+          break;
+        }
+        condition_throw(
+          activelock && timeout && locktoken && href
+        ) UnspecifiedException("prop unexpected");
 
-          if (xmlStrscmp(href->children->content, BAD_CAST token->str) != 0) {
-            throw UnspecifiedException("lock href mismatched");
+        if (xmlStrscmp(href->children->content, BAD_CAST token->str) != 0) {
+          throw UnspecifiedException("lock href mismatched");
+        }
+
+        if (timeout->children) {
+          const xmlChar *granted = timeout->children->content;
+          if (xmlStrscmp(granted, BAD_CAST "Infinite") == 0) {
+            *timeoutp = 0;
+          } else if (xmlStrscmp(granted, BAD_CAST "Second-") == 0) {
+            *timeoutp = strtol((const char *) granted + strlen("Second-"), NULL, 10);
           }
         }
-      #endif
-    #if 1
       }
     #endif
+  #if 1
     }
+  #endif
   } onerror (e) {
     delete(SimpleString) token;
     token = NULL;
@@ -596,68 +1153,125 @@ static SimpleString *__dav_lock (struct DavServer *server, const char *path) {
 
 
 static int __dav_unlock (struct DavServer *server, const char *path, SimpleString *token) {
-  with_curl (curl, server->baseuh, path, server->options) {
-    char token_header[sizeof("Lock-Token: <>") + token->len];
-    snprintf(token_header, sizeof(token_header), "Lock-Token: <%s>", token->str);
-    throwable scope (curl_slist, list, token_header) {
+  /* lost already */
+  if unlikely (token == NULL) {
+    return 0;
+  }
+
+  Arena *arena = dav_arena();
+  with_arena_mark (arena) with_curl (curl, server->baseuh, path, server->options) {
+    char *token_header = Arena_printf(arena, "Lock-Token: <%s>", token->str);
+    if unlikely (token_header == NULL) {
+      break;
+    }
+    throwable with (struct curl_slist *list = curl_slist_append_arena(arena, NULL, token_header)) {
       curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
       curl_easy_setopt_or_die(curl, CURLOPT_CUSTOMREQUEST, "UNLOCK");
-      curl_easy_perform_or_die(curl);
+      curl_easy_perform_or_die(curl, CURL_CLASS_META);
     }
   }
   return TEST_SUCCESS;
 }
 
 
-int dav_lock (struct DavServer *server, const char *path) {
-  if (!server->options->use_lock) {
-    return 0;
-  }
+/* The ETag getattr has most likely just seen, or one asked for with HEAD */
+static SimpleString *__dav_etag (struct DavServer *server, const char *path) {
+  char etag[DAV_CACHE_ETAG_MAX] = "";
 
-  struct FileLock *filelock = NULL;
-  synchronized (rwlock, &server->filelock_tree_lock, rdlock) {
-    struct FileLock **filelock_p = tfind(&path, &server->filelock_tree, __dav_strpcmp);
-    if (filelock_p) {
-      filelock = *filelock_p;
-      filelock->cnt++;
+  if (!dav_cache_get_etag(&server->cache, path, etag) || strscmp(etag, "W/") == 0) {
+    etag[0] = '\0';
+    with_curl (curl, server->baseuh, path, server->options) {
+      curl_easy_setopt_or_die(curl, CURLOPT_CUSTOMREQUEST, "HEAD");
+      curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+      curl_easy_perform_idempotent_or_die(
+        curl, CURL_CLASS_META, NULL, NULL, __dav_etag_callback, etag);
     }
   }
-  if (filelock) {
+
+  return etag[0] != '\0' ? new(SimpleString) (etag) : NULL;
+}
+
+
+int dav_lock (struct DavServer *server, const char *path) {
+  if (!__dav_guarded(server)) {
     return 0;
   }
 
-  try {
-    throwable filelock = malloc_et(struct FileLock);
-    try {
-      filelock->path = NULL;
-      filelock->token = NULL;
-      filelock->cnt = 1;
-      filelock->path = strdup(path);
-      condition_throw(filelock->path) MallocException("path dup");
-      throwable synchronized (rwlock, &server->filelock_tree_lock, wrlock) {
-        struct FileLock **exist_filelock_p = tfind(&path, &server->filelock_tree, __dav_strpcmp);
-        if (exist_filelock_p) {
-          struct FileLock *exist_filelock = *exist_filelock_p;
-          exist_filelock->cnt++;
-          free(filelock->path);
-          filelock->path = NULL;
-          free(filelock);
-          filelock = NULL;
-          break;
-        }
-        throwable filelock->token = __dav_lock(server, path);
-        struct FileLock **filelock_p = tsearch(filelock, &server->filelock_tree, __dav_strpcmp);
-        condition_throw(filelock_p)
-          MallocException("filelock table insert");
+  size_t hash = HashMap_hash(path);
+  HashMapShard *shard = HashMap_shard(&server->filelocks, hash);
+  struct FileLock *filelock = NULL;
+  struct FileLock *relock = NULL;
+  int res = 0;
+
+  synchronized (mutex, &shard->lock, lock) {
+    bool failed = false;
+    struct FileLock *held = __dav_filelock_find(shard, path, hash, &failed);
+    if (held) {
+      held->cnt++;
+      if unlikely (held->token == NULL && !server->use_etag) {
+        /* lost while open, locked again for all its opens */
+        held->state = FILE_LOCK_LOCKING;
+        held->refs++;
+        relock = held;
       }
-    } onerror (e) {
-      free(filelock->path);
-      if (filelock->token) {
-        __dav_unlock(server, path, filelock->token);
+      break;
+    }
+    if unlikely (failed) {
+      UnspecifiedException("LOCK of the same path failed");
+      res = 1;
+      break;
+    }
+
+    filelock = FileLock_new(path, hash);
+    if unlikely (filelock == NULL) {
+      MallocException("filelock");
+      res = 1;
+      break;
+    }
+    if unlikely (HashMapShard_insert(shard, (HashMapEntry *) filelock)) {
+      delete(FileLock) filelock;
+      filelock = NULL;
+      MallocException("filelock table insert");
+      res = 1;
+    }
+  }
+  if unlikely (relock) {
+    long timeout = 0;
+    SimpleString *token = __dav_lock(server, path, &timeout);
+    synchronized (mutex, &shard->lock, lock) {
+      relock->token = token;
+      relock->lifetime = timeout;
+      relock->refresh_at = timeout > 0 ? dav_lease_now() + timeout / 2 : 0;
+      if (token == NULL) {
+        /* this open fails, the others go on without a lock */
+        relock->cnt--;
       }
+      __dav_filelock_settle(shard, relock, FILE_LOCK_HELD);
+      __dav_filelock_put(relock);
     }
-  } onerror (e) {
-    free(filelock);
+    return TEST_SUCCESS;
+  }
+  if (filelock == NULL) {
+    return res;
+  }
+
+  /* opens of the same path meanwhile wait for us rather than sending their
+   * own LOCK */
+  long timeout = 0;
+  SimpleString *token;
+  bool held;
+  if (server->use_etag) {
+    token = __dav_etag(server, path);
+    held = !Exception_has(&ex);
+  } else {
+    token = __dav_lock(server, path, &timeout);
+    held = token != NULL;
+  }
+  synchronized (mutex, &shard->lock, lock) {
+    filelock->token = token;
+    filelock->lifetime = timeout;
+    filelock->refresh_at = timeout > 0 ? dav_lease_now() + timeout / 2 : 0;
+    __dav_filelock_settle(shard, filelock, held ? FILE_LOCK_HELD : FILE_LOCK_FAILED);
   }
 
   return TEST_SUCCESS;
@@ -665,49 +1279,189 @@ int dav_lock (struct DavServer *server, const char *path) {
 
 
 int dav_unlock (struct DavServer *server, const char *path) {
-  if (!server->options->use_lock) {
+  if (!__dav_guarded(server)) {
     return 0;
   }
 
+  size_t hash = HashMap_hash(path);
+  HashMapShard *shard = HashMap_shard(&server->filelocks, hash);
+  struct FileLock *filelock = NULL;
   int res = 0;
 
-  struct FileLock *filelock = NULL;
-  synchronized (rwlock, &server->filelock_tree_lock, rdlock) {
-    struct FileLock **filelock_p = tfind(&path, &server->filelock_tree, __dav_strpcmp);
-    if likely (filelock_p) {
-      filelock = *filelock_p;
-    }
+  synchronized (mutex, &shard->lock, lock) {
+    filelock = __dav_filelock_find(shard, path, hash, NULL);
     should (filelock) otherwise {
       UnspecifiedException("release cannot find file lock");
       res = 1;
       break;
     }
-    auto cnt_remain = --filelock->cnt;
-    if (cnt_remain > 0) {
+    if (--filelock->cnt > 0) {
+      filelock = NULL;
+      break;
+    }
+    if (server->use_etag) {
+      /* nothing to tell the server */
+      __dav_filelock_settle(shard, filelock, FILE_LOCK_RELEASED);
       filelock = NULL;
+      break;
     }
+    if (server->lease_running) {
+      /* the lease keeper unlocks it unless it is opened again */
+      filelock->idle_since = dav_lease_now();
+      filelock = NULL;
+      break;
+    }
+    /* stays in the map so that a new open waits for the UNLOCK */
+    filelock->state = FILE_LOCK_UNLOCKING;
   }
   if (filelock == NULL) {
     return res;
   }
 
-  synchronized (rwlock, &server->filelock_tree_lock, wrlock) {
-    struct FileLock **filelock_p = tfind(&path, &server->filelock_tree, __dav_strpcmp);
-    if (filelock_p == NULL) {
-      break;
+  res = __dav_unlock(server, filelock->path, filelock->token);
+  synchronized (mutex, &shard->lock, lock) {
+    __dav_filelock_settle(shard, filelock, FILE_LOCK_RELEASED);
+  }
+  return res;
+}
+
+
+/* RFC 4918 9.10.2, a LOCK without body naming the token extends it. lost
+ * tells whether the server no longer knows the token. */
+static int __dav_lock_refresh (struct DavServer *server, const char *path, SimpleString *token, bool *lost) {
+  *lost = false;
+  Arena *arena = dav_arena();
+  with_arena_mark (arena) with_curl (curl, server->baseuh, path, server->options) {
+    char *if_header = Arena_printf(arena, "If: (<%s>)", token->str);
+    check;
+    char *timeout_header = Arena_printf(
+      arena, "Timeout: Second-%ld", server->options->lock_timeout);
+    check;
+    throwable with (struct curl_slist *list = curl_slist_append_arena(arena, NULL, if_header)) {
+      throwable list = curl_slist_append_arena(arena, list, timeout_header);
+      curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
+      curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, __dav_discard);
+      curl_easy_setopt_or_die(curl, CURLOPT_CUSTOMREQUEST, "LOCK");
+      CURLcode res = curl_easy_perform_common(curl, CURL_CLASS_META);
+      if (res == CURLE_HTTP_RETURNED_ERROR) {
+        long response_code = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+        /* expired or broken by someone else */
+        *lost = response_code == 404 || response_code == 412 || response_code == 423;
+      }
+      curl_do_or_die(res, CURL_PERFORM, curl);
     }
-    if ((*filelock_p)->cnt <= 0) {
-      filelock = *filelock_p;
-      tdelete(filelock, &server->filelock_tree, __dav_strpcmp);
+  }
+  return TEST_SUCCESS;
+}
+
+
+/* One pass of the lease keeper. Locks due are collected under the shard
+ * locks, then refreshed or unlocked one after another without them. */
+static void __dav_lease_tick (struct DavServer *server) {
+  const struct networkfs_opts *options = server->options;
+  time_t now = dav_lease_now();
+  struct FileLock *refresh = NULL;
+  struct FileLock *unlock = NULL;
+
+  for (int i = 0; i < HASHMAP_SHARDS; i++) {
+    HashMapShard *shard = &server->filelocks.shards[i];
+    synchronized (mutex, &shard->lock, lock) {
+      foreach(HashMapShard) (entry, shard) {
+        struct FileLock *filelock = (struct FileLock *) entry;
+        if (filelock->state != FILE_LOCK_HELD) {
+          continue;
+        }
+        if (filelock->cnt == 0 && now - filelock->idle_since >= options->lock_linger) {
+          /* stays in the map so that a new open waits for the UNLOCK */
+          filelock->state = FILE_LOCK_UNLOCKING;
+          filelock->lease_next = unlock;
+          unlock = filelock;
+        } else if (filelock->refresh_at != 0 && now >= filelock->refresh_at) {
+          filelock->refs++;
+          filelock->lease_next = refresh;
+          refresh = filelock;
+        }
+      }
     }
   }
-  if (filelock == NULL) {
-    return 0;
+
+  for (struct FileLock *filelock = refresh, *next; filelock; filelock = next) {
+    next = filelock->lease_next;
+    bool lost;
+    int res = __dav_lock_refresh(server, filelock->path, filelock->token, &lost);
+    if unlikely (res) {
+      Exception_destory(&ex);
+    }
+
+    HashMapShard *shard = HashMap_shard(&server->filelocks, filelock->hash);
+    synchronized (mutex, &shard->lock, lock) {
+      if likely (res == 0) {
+        filelock->refresh_at = dav_lease_now() + filelock->lifetime / 2;
+      } else if (lost && filelock->state == FILE_LOCK_HELD) {
+        /* writes would carry a dead token and fail, they go without one
+         * until the next open locks again */
+        fprintf(stderr, "Lock of %s lost\n", filelock->path);
+        if (filelock->cnt == 0) {
+          /* ours goes first, the map still holds one */
+          filelock->refs--;
+          __dav_filelock_settle(shard, filelock, FILE_LOCK_RELEASED);
+          break;
+        }
+        delete(SimpleString) filelock->token;
+        filelock->token = NULL;
+        filelock->refresh_at = 0;
+      }
+      /* tried again next pass otherwise */
+      __dav_filelock_put(filelock);
+    }
   }
 
-  res = __dav_unlock(server, filelock->path, filelock->token);
-  delete(FileLock) filelock;
-  return res;
+  for (struct FileLock *filelock = unlock, *next; filelock; filelock = next) {
+    next = filelock->lease_next;
+    if unlikely (__dav_unlock(server, filelock->path, filelock->token)) {
+      Exception_destory(&ex);
+    }
+
+    HashMapShard *shard = HashMap_shard(&server->filelocks, filelock->hash);
+    synchronized (mutex, &shard->lock, lock) {
+      __dav_filelock_settle(shard, filelock, FILE_LOCK_RELEASED);
+    }
+  }
+}
+
+
+static void *__dav_lease_keeper (void *arg) {
+  struct DavServer *server = (struct DavServer *) arg;
+  const struct networkfs_opts *options = server->options;
+
+  /* often enough for both lock_linger and half the lock lifetime */
+  time_t tick = options->lock_timeout / 4;
+  if (tick > options->lock_linger) {
+    tick = options->lock_linger;
+  }
+  if (tick < 1) {
+    tick = 1;
+  }
+
+  while (true) {
+    bool stop;
+    synchronized (mutex, &server->lease_lock, lock) {
+      if (!server->lease_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += tick;
+        pthread_cond_timedwait(&server->lease_cond, &server->lease_lock, &deadline);
+      }
+      stop = server->lease_stop;
+    }
+    if (stop) {
+      break;
+    }
+    __dav_lease_tick(server);
+  }
+
+  return NULL;
 }
 
 
@@ -749,7 +1503,7 @@ int dav_options (struct DavServer *server) {
 
       /* handle redirect */
       curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 0L);
-      curl_easy_perform_or_die(curl);
+      curl_do_or_die(curl_easy_perform(curl), CURL_PERFORM, curl);
 
       long response_code;
       curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
@@ -780,7 +1534,7 @@ int dav_options (struct DavServer *server) {
       curl_easy_setopt_or_die(curl, CURLOPT_CUSTOMREQUEST, "OPTIONS");
       curl_easy_setopt(curl, CURLOPT_HEADERDATA, server);
       curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, __dav_options_callback);
-      curl_easy_perform_or_die(curl);
+      curl_do_or_die(curl_easy_perform(curl), CURL_PERFORM, curl);
     }
 
     if unlikely (server->LOCK != server->UNLOCK) {
@@ -789,9 +1543,17 @@ int dav_options (struct DavServer *server) {
       server->UNLOCK = false;
     }
 
-    if (server->options->use_lock) {
-      server->filelock_tree = NULL;
-      pthread_rwlock_init(&server->filelock_tree_lock, NULL);
+    server->use_etag = server->options->use_etag && !server->options->use_lock;
+    if (__dav_guarded(server)) {
+      HashMap_init(&server->filelocks);
+      server->lease_running = false;
+      if (server->options->use_lock && server->options->lock_linger > 0) {
+        pthread_mutex_init(&server->lease_lock, NULL);
+        pthread_cond_init(&server->lease_cond, NULL);
+        server->lease_stop = false;
+        server->lease_running =
+          pthread_create(&server->lease_thread, NULL, __dav_lease_keeper, server) == 0;
+      }
     }
   } onerror (e) {}
 
@@ -802,18 +1564,30 @@ int dav_options (struct DavServer *server) {
 static struct DavServer *__dav_unlock_node_server;
 
 
-static void __dav_unlock_node (void *nodep) {
-  struct FileLock *filelock = (struct FileLock *) nodep;
-  __dav_unlock(__dav_unlock_node_server, filelock->path, filelock->token);
+static void __dav_unlock_node (HashMapEntry *entry) {
+  struct FileLock *filelock = (struct FileLock *) entry;
+  if (filelock->state == FILE_LOCK_HELD && !__dav_unlock_node_server->use_etag) {
+    __dav_unlock(__dav_unlock_node_server, filelock->path, filelock->token);
+  }
   delete(FileLock) filelock;
 }
 
 
 void dav_destory (struct DavServer *server) {
-  if (server->options->use_lock) {
+  if (__dav_guarded(server)) {
+    if (server->lease_running) {
+      synchronized (mutex, &server->lease_lock, lock) {
+        server->lease_stop = true;
+        pthread_cond_signal(&server->lease_cond);
+      }
+      pthread_join(server->lease_thread, NULL);
+      pthread_cond_destroy(&server->lease_cond);
+      pthread_mutex_destroy(&server->lease_lock);
+    }
+    /* everything still held, including the lingering ones */
     __dav_unlock_node_server = server;
-    tdestroy(server->filelock_tree, __dav_unlock_node);
-    pthread_rwlock_destroy(&server->filelock_tree_lock);
+    HashMap_destory(&server->filelocks, __dav_unlock_node);
   }
+  dav_cache_destory(&server->cache);
   delete(CURLU) server->baseuh;
 }
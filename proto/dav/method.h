@@ -1,6 +1,7 @@
 #ifndef PROTO_DAV_METHOD_H
 #define PROTO_DAV_METHOD_H
 
+#include <stdatomic.h>
 #include <stdbool.h>
 
 #ifndef FUSE_USE_VERSION
@@ -11,6 +12,8 @@
 #include <curl/curl.h>
 
 #include <opts.h>
+#include <template/hashmap.h>
+#include "cache.h"
 
 
 #define DAV_METHOD \
@@ -33,15 +36,35 @@
 struct DavServer {
   CURLU *baseuh;
   const struct networkfs_opts *options;
-  void *filelock_tree;
-  pthread_rwlock_t filelock_tree_lock;
+  /* struct FileLock by path */
+  HashMap filelocks;
+  /* refreshes held locks and unlocks the ones nobody opened for a while */
+  pthread_t lease_thread;
+  pthread_mutex_t lease_lock;
+  pthread_cond_t lease_cond;
+  bool lease_running;
+  bool lease_stop;
+  /* filelocks hold the ETag seen at open rather than a lock token */
+  bool use_etag;
   char *server;
   char *version;
+  struct DavCache cache;
+  /* whether the server keeps our NETWORKFS: dead properties, learned from
+   * PROPFIND and PROPPATCH responses */
+  atomic_int dead_props;
+  /* listing responses in a row without any of them */
+  atomic_uint dead_props_misses;
 #define X(o) bool o;
   DAV_METHOD
 #undef X
 };
 
+enum DavDeadProps {
+  DAV_DEAD_PROPS_UNKNOWN = 0,
+  DAV_DEAD_PROPS_PRESENT,
+  DAV_DEAD_PROPS_ABSENT,
+};
+
 enum LockType {
   RW_LOCK_NONE = 0,
   RW_LOCK_READ,
@@ -67,6 +90,13 @@ inline int dav_delete (struct DavServer *server, const char *path) {
 int dav_head (struct DavServer *server, const char *path, size_t *sizep);
 ssize_t dav_get (struct DavServer *server, const char *path, char *data, size_t size, off_t offset);
 int dav_put (struct DavServer *server, const char *path, const char *data, size_t size, off_t offset);
+int dav_put_zeros (struct DavServer *server, const char *path, off_t offset, size_t size);
+/* cuts the content down to its first `size` bytes, with a single PUT */
+int dav_put_prefix (struct DavServer *server, const char *path, size_t size);
+/* replaces the whole content, under the same conditions as dav_put */
+int dav_put_whole (struct DavServer *server, const char *path, const char *data, size_t size);
+/* whole content of a file which must not exist yet, 412 if it does */
+int dav_put_new (struct DavServer *server, const char *path, const char *data, size_t size);
 
 int __dav_move (struct DavServer *server, const char *from, const char *to, bool nooverwrite);
 
@@ -80,7 +110,19 @@ inline int dav_move_nooverwrite (struct DavServer *server, const char *from, con
 
 int dav_copy (struct DavServer *server, const char *from, const char *to);
 int dav_propfind (struct DavServer *server, const char *path, int depth, void *buf, fuse_fill_dir_t filler);
-int dav_proppatch (struct DavServer *server, const char *path, const char *key, const char *value);
+
+/* value NULL to remove the property */
+struct DavPropUpdate {
+  const char *key;
+  const char *value;
+};
+
+int dav_proppatch_n (struct DavServer *server, const char *path, const struct DavPropUpdate *props, size_t n);
+
+inline int dav_proppatch (struct DavServer *server, const char *path, const char *key, const char *value) {
+  return dav_proppatch_n(server, path, &(struct DavPropUpdate) {key, value}, 1);
+}
+
 int dav_lock (struct DavServer *server, const char *path);
 int dav_unlock (struct DavServer *server, const char *path);
 int dav_options (struct DavServer *server);
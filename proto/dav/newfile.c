@@ -0,0 +1,335 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <grammar/synchronized.h>
+#include "newfile.h"
+
+
+/* expects the shard lock, waits out an upload of the file */
+static struct DavNewFile *dav_newfile_find (HashMapShard *shard, const char *path, size_t hash) {
+  struct DavNewFile *file;
+
+  while ((file = (struct DavNewFile *) HashMapShard_find(shard, path, hash)) && file->uploading) {
+    file->waiters++;
+    while (file->uploading) {
+      pthread_cond_wait(&file->cond, &shard->lock);
+    }
+    if (--file->waiters == 0) {
+      pthread_cond_broadcast(&file->cond);
+    }
+  }
+  return file;
+}
+
+
+static bool dav_newfile_resize (struct DavNewFiles *files, struct DavNewFile *file, size_t size) {
+  if unlikely (size > files->max_size) {
+    return false;
+  }
+
+  if (size > file->capacity) {
+    size_t capacity = file->capacity * 2;
+    if (capacity < size) {
+      capacity = size;
+    }
+    if (capacity > files->max_size) {
+      capacity = files->max_size;
+    }
+    char *data = realloc(file->data, capacity);
+    if unlikely (data == NULL) {
+      return false;
+    }
+    file->data = data;
+    file->capacity = capacity;
+  }
+  if (size > file->size) {
+    memset(file->data + file->size, 0, size - file->size);
+  }
+  file->size = size;
+  return true;
+}
+
+
+static void dav_newfile_free (HashMapEntry *entry) {
+  struct DavNewFile *file = (struct DavNewFile *) entry;
+  pthread_cond_destroy(&file->cond);
+  free(file->data);
+  free(file);
+}
+
+
+bool dav_newfile_getattr (struct DavNewFiles *files, const char *path, struct stat *st) {
+  size_t hash = HashMap_hash(path);
+  HashMapShard *shard = HashMap_shard(&files->map, hash);
+  bool found = false;
+
+  synchronized (mutex, &shard->lock, lock) {
+    struct DavNewFile *file = dav_newfile_find(shard, path, hash);
+    if (file == NULL) {
+      break;
+    }
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode = file->mode;
+    st->st_nlink = 1;
+    st->st_size = file->size;
+    st->st_mtime = st->st_ctime = st->st_atime = file->mtime;
+    found = true;
+  }
+  return found;
+}
+
+
+bool dav_newfile_read (
+    struct DavNewFiles *files, const char *path, char *buf, size_t size, off_t offset, int *resp) {
+  size_t hash = HashMap_hash(path);
+  HashMapShard *shard = HashMap_shard(&files->map, hash);
+  bool found = false;
+
+  synchronized (mutex, &shard->lock, lock) {
+    struct DavNewFile *file = dav_newfile_find(shard, path, hash);
+    if (file == NULL) {
+      break;
+    }
+    if ((size_t) offset >= file->size) {
+      size = 0;
+    } else if (size > file->size - offset) {
+      size = file->size - offset;
+    }
+    memcpy(buf, file->data + offset, size);
+    *resp = size;
+    found = true;
+  }
+  return found;
+}
+
+
+bool dav_newfile_write (
+    struct DavNewFiles *files, const char *path, const char *buf, size_t size, off_t offset) {
+  size_t hash = HashMap_hash(path);
+  HashMapShard *shard = HashMap_shard(&files->map, hash);
+  bool done = false;
+
+  synchronized (mutex, &shard->lock, lock) {
+    struct DavNewFile *file = dav_newfile_find(shard, path, hash);
+    if (file == NULL) {
+      break;
+    }
+    if (offset + size > file->size && !dav_newfile_resize(files, file, offset + size)) {
+      break;
+    }
+    memcpy(file->data + offset, buf, size);
+    file->mtime = time(NULL);
+    done = true;
+  }
+  return done;
+}
+
+
+bool dav_newfile_truncate (struct DavNewFiles *files, const char *path, off_t size) {
+  size_t hash = HashMap_hash(path);
+  HashMapShard *shard = HashMap_shard(&files->map, hash);
+  bool done = false;
+
+  synchronized (mutex, &shard->lock, lock) {
+    struct DavNewFile *file = dav_newfile_find(shard, path, hash);
+    if (file == NULL || !dav_newfile_resize(files, file, size)) {
+      break;
+    }
+    file->mtime = time(NULL);
+    done = true;
+  }
+  return done;
+}
+
+
+bool dav_newfile_discard (struct DavNewFiles *files, const char *path) {
+  size_t hash = HashMap_hash(path);
+  HashMapShard *shard = HashMap_shard(&files->map, hash);
+  struct DavNewFile *file;
+
+  synchronized (mutex, &shard->lock, lock) {
+    file = dav_newfile_find(shard, path, hash);
+    if (file) {
+      HashMapShard_remove(shard, path, hash);
+    }
+  }
+
+  if (file == NULL) {
+    return false;
+  }
+  dav_newfile_free((HashMapEntry *) file);
+  return true;
+}
+
+
+bool dav_newfile_close (struct DavNewFiles *files, const char *path) {
+  size_t hash = HashMap_hash(path);
+  HashMapShard *shard = HashMap_shard(&files->map, hash);
+  bool found = false;
+
+  synchronized (mutex, &shard->lock, lock) {
+    struct DavNewFile *file = dav_newfile_find(shard, path, hash);
+    if (file == NULL) {
+      break;
+    }
+    file->closed = true;
+    clock_gettime(CLOCK_MONOTONIC, &file->closed_at);
+    found = true;
+  }
+  return found;
+}
+
+
+static inline bool dav_newfile_in (const char *path, const char *dir) {
+  size_t len = strlen(dir);
+  if (len == 1) {
+    /* the root */
+    len = 0;
+  } else if (strncmp(path, dir, len) != 0 || path[len] != '/') {
+    return false;
+  }
+  return strchr(path + len + 1, '/') == NULL;
+}
+
+
+static inline double dav_newfile_elapsed (const struct timespec *since, const struct timespec *now) {
+  return (now->tv_sec - since->tv_sec) + (now->tv_nsec - since->tv_nsec) / 1e9;
+}
+
+
+size_t dav_newfile_due (struct DavNewFiles *files, double delay, const char *dir, char ***pathsp) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  char **paths = NULL;
+  size_t npath = 0;
+  size_t capacity = 0;
+
+  for (int i = 0; i < HASHMAP_SHARDS; i++) {
+    HashMapShard *shard = &files->map.shards[i];
+    synchronized (mutex, &shard->lock, lock) {
+      foreach(HashMapShard) (entry, shard) {
+        struct DavNewFile *file = (struct DavNewFile *) entry;
+        if (!file->closed || file->uploading || (dir && !dav_newfile_in(file->path, dir))) {
+          continue;
+        }
+        if (delay >= 0 && (dav_newfile_elapsed(&file->closed_at, &now) < delay ||
+                           (file->failed && dav_newfile_elapsed(&file->failed_at, &now) < DAV_NEWFILE_RETRY))) {
+          continue;
+        }
+        if (npath == capacity) {
+          size_t new_capacity = capacity ? capacity * 2 : 16;
+          char **new_paths = realloc(paths, new_capacity * sizeof(char *));
+          if unlikely (new_paths == NULL) {
+            /* the rest waits for the next round */
+            break;
+          }
+          paths = new_paths;
+          capacity = new_capacity;
+        }
+        paths[npath] = strdup(file->path);
+        if likely (paths[npath]) {
+          npath++;
+        }
+      }
+    }
+  }
+
+  *pathsp = paths;
+  return npath;
+}
+
+
+struct DavNewFile *dav_newfile_take (struct DavNewFiles *files, const char *path) {
+  size_t hash = HashMap_hash(path);
+  HashMapShard *shard = HashMap_shard(&files->map, hash);
+  struct DavNewFile *file;
+
+  synchronized (mutex, &shard->lock, lock) {
+    file = dav_newfile_find(shard, path, hash);
+    if (file) {
+      file->uploading = true;
+    }
+  }
+  return file;
+}
+
+
+void dav_newfile_done (struct DavNewFiles *files, struct DavNewFile *file) {
+  HashMapShard *shard = HashMap_shard(&files->map, file->hash);
+
+  synchronized (mutex, &shard->lock, lock) {
+    HashMapShard_remove(shard, file->path, file->hash);
+    file->uploading = false;
+    pthread_cond_broadcast(&file->cond);
+    while (file->waiters > 0) {
+      pthread_cond_wait(&file->cond, &shard->lock);
+    }
+  }
+  dav_newfile_free((HashMapEntry *) file);
+}
+
+
+void dav_newfile_return (struct DavNewFiles *files, struct DavNewFile *file) {
+  HashMapShard *shard = HashMap_shard(&files->map, file->hash);
+
+  synchronized (mutex, &shard->lock, lock) {
+    file->uploading = false;
+    file->failed = true;
+    clock_gettime(CLOCK_MONOTONIC, &file->failed_at);
+    pthread_cond_broadcast(&file->cond);
+  }
+}
+
+
+int dav_newfile_create (struct DavNewFiles *files, const char *path, mode_t mode) {
+  size_t hash = HashMap_hash(path);
+  HashMapShard *shard = HashMap_shard(&files->map, hash);
+  int res = 0;
+
+  size_t len = strlen(path);
+  struct DavNewFile *file = malloc(sizeof(struct DavNewFile) + len + 1);
+  if unlikely (file == NULL) {
+    return -ENOMEM;
+  }
+  memcpy(file->path, path, len + 1);
+  file->key = file->path;
+  file->hash = hash;
+  file->uploading = false;
+  file->waiters = 0;
+  file->closed = false;
+  file->failed = false;
+  file->mode = S_IFREG | (mode & 07777);
+  file->mtime = time(NULL);
+  file->data = NULL;
+  file->size = 0;
+  file->capacity = 0;
+  pthread_cond_init(&file->cond, NULL);
+
+  synchronized (mutex, &shard->lock, lock) {
+    if (dav_newfile_find(shard, path, hash)) {
+      res = -EEXIST;
+      break;
+    }
+    if unlikely (HashMapShard_insert(shard, (HashMapEntry *) file)) {
+      res = -ENOMEM;
+    }
+  }
+
+  if unlikely (res) {
+    dav_newfile_free((HashMapEntry *) file);
+  }
+  return res;
+}
+
+
+void dav_newfile_destory (struct DavNewFiles *files) {
+  HashMap_destory(&files->map, dav_newfile_free);
+}
+
+
+int dav_newfile_init (struct DavNewFiles *files, size_t max_size) {
+  files->max_size = max_size;
+  return HashMap_init(&files->map);
+}
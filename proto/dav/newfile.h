@@ -0,0 +1,71 @@
+#ifndef PROTO_DAV_NEWFILE_H
+#define PROTO_DAV_NEWFILE_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <template/hashmap.h>
+
+
+/* Files created but not uploaded yet. Their content is kept here until the
+ * first close sends it with a single PUT, or until it grows too large. With
+ * save_delay they are held a while past the close, for a rename to send them
+ * under the new name instead. */
+#define DAV_NEWFILE_RETRY 5
+
+struct DavNewFiles {
+  HashMap map;
+  size_t max_size;
+};
+
+struct DavNewFile {
+  HashMapEntry;
+  pthread_cond_t cond;
+  /* taken for upload, lookups wait until it is gone */
+  bool uploading;
+  unsigned int waiters;
+  /* held since `closed_at` */
+  bool closed;
+  struct timespec closed_at;
+  /* last upload attempt failed at `failed_at` */
+  bool failed;
+  struct timespec failed_at;
+  mode_t mode;
+  time_t mtime;
+  char *data;
+  size_t size;
+  size_t capacity;
+  char path[];
+};
+
+
+/* The functions below return false if `path` is not a new file, or, for
+ * write and truncate, if it would grow past max_size. */
+bool dav_newfile_getattr (struct DavNewFiles *files, const char *path, struct stat *st);
+bool dav_newfile_read (
+  struct DavNewFiles *files, const char *path, char *buf, size_t size, off_t offset, int *resp);
+bool dav_newfile_write (
+  struct DavNewFiles *files, const char *path, const char *buf, size_t size, off_t offset);
+bool dav_newfile_truncate (struct DavNewFiles *files, const char *path, off_t size);
+bool dav_newfile_discard (struct DavNewFiles *files, const char *path);
+bool dav_newfile_close (struct DavNewFiles *files, const char *path);
+/* files closed at least `delay` seconds ago, or all of them if negative,
+ * only those directly in `dir` unless NULL, for the caller to free. A failed
+ * upload is only due again DAV_NEWFILE_RETRY seconds later. */
+size_t dav_newfile_due (struct DavNewFiles *files, double delay, const char *dir, char ***pathsp);
+
+/* Takes the file for upload, NULL if there is none. Its content stays
+ * valid until dav_newfile_done. */
+struct DavNewFile *dav_newfile_take (struct DavNewFiles *files, const char *path);
+void dav_newfile_done (struct DavNewFiles *files, struct DavNewFile *file);
+/* gives the file back after its upload failed */
+void dav_newfile_return (struct DavNewFiles *files, struct DavNewFile *file);
+
+int dav_newfile_create (struct DavNewFiles *files, const char *path, mode_t mode);
+void dav_newfile_destory (struct DavNewFiles *files);
+int dav_newfile_init (struct DavNewFiles *files, size_t max_size);
+
+
+#endif /* PROTO_DAV_NEWFILE_H */
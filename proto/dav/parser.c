@@ -1,5 +1,6 @@
 #define _GNU_SOURCE
 
+#include <stdint.h>
 #include <string.h>
 
 #include <grammar/try.h>
@@ -10,41 +11,152 @@
 #include "parser.h"
 
 
-static void __attribute__((constructor)) parser_init (void) {
-  tzset();
+/* parses exactly `n` digits */
+static inline bool xmlParserDigits (const char **p, int n, int *result) {
+  int value = 0;
+  for (int i = 0; i < n; i++) {
+    unsigned int digit = (unsigned char) (*p)[i] - '0';
+    if unlikely (digit > 9) {
+      return false;
+    }
+    value = value * 10 + digit;
+  }
+  *p += n;
+  *result = value;
+  return true;
 }
 
 
-time_t xmlParserTimeNode (xmlNodePtr const node) {
-  foreach(LinkedList) (attribute, node->properties) {
-    if (xmlStrcmp(attribute->name, BAD_CAST "dt") == 0) {
-      break_after {
-        auto datetime = attribute->children;
-        if (datetime && datetime->content &&
-            xmlStrscmp(datetime->content, BAD_CAST "dateTime.") == 0) {
-          auto format_name = datetime->content + strlen("dateTime.");
-          const char *format;
-          if (xmlStrscmp(format_name, BAD_CAST "tz") == 0) {
-            format = "%FT%TZ";
-          } else if (xmlStrscmp(format_name, BAD_CAST "rfc1123") == 0) {
-            format = "%a, %d %b %Y %T GMT";
-          } else {
-            fprintf(stderr, "Unknown time format %s\n", format_name);
-            break;
-          }
+static inline bool xmlParserExpect (const char **p, char c) {
+  if unlikely (**p != c) {
+    return false;
+  }
+  (*p)++;
+  return true;
+}
 
-          if likely (node->children && node->children->content) {
-            struct tm tm;
-            if likely (strptime((const char *) node->children->content, format, &tm)) {
-              return mktime(&tm) - timezone;
-            }
-          }
-        }
+
+/* days since 1970-01-01 of a proleptic Gregorian date, see
+ * http://howardhinnant.github.io/date_algorithms.html#days_from_civil */
+static inline int64_t xmlParserDays (int year, int month, int day) {
+  year -= month <= 2;
+  int64_t era = (year >= 0 ? year : year - 399) / 400;
+  int64_t yoe = year - era * 400;
+  int64_t doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+
+static inline time_t xmlParserEpoch (
+    int year, int month, int day, int hour, int minute, int second, int offset) {
+  if unlikely (month < 1 || month > 12 || day < 1 || day > 31 ||
+               hour > 23 || minute > 59 || second > 60) {
+    return 0;
+  }
+  return xmlParserDays(year, month, day) * 86400 + hour * 3600 + minute * 60 + second - offset;
+}
+
+
+/* RFC 3339 profile of ISO 8601, e.g. 1997-12-01T17:42:21.5-08:00 */
+static time_t xmlParserTimeISO8601 (const char *p) {
+  int year, month, day, hour, minute, second;
+  if unlikely (!(xmlParserDigits(&p, 4, &year) && xmlParserExpect(&p, '-') &&
+                 xmlParserDigits(&p, 2, &month) && xmlParserExpect(&p, '-') &&
+                 xmlParserDigits(&p, 2, &day) && (*p == 'T' || *p == 't' || *p == ' ') &&
+                 (p++, xmlParserDigits(&p, 2, &hour)) && xmlParserExpect(&p, ':') &&
+                 xmlParserDigits(&p, 2, &minute) && xmlParserExpect(&p, ':') &&
+                 xmlParserDigits(&p, 2, &second))) {
+    return 0;
+  }
+
+  if (*p == '.' || *p == ',') {
+    do {
+      p++;
+    } while ((unsigned int) *p - '0' <= 9);
+  }
+
+  int offset = 0;
+  if (*p == '+' || *p == '-') {
+    int sign = *p++ == '-' ? -1 : 1;
+    int offset_hour, offset_minute = 0;
+    if unlikely (!xmlParserDigits(&p, 2, &offset_hour)) {
+      return 0;
+    }
+    if (*p == ':' || (unsigned int) *p - '0' <= 9) {
+      xmlParserExpect(&p, ':');
+      if unlikely (!xmlParserDigits(&p, 2, &offset_minute)) {
+        return 0;
       }
     }
+    offset = sign * (offset_hour * 3600 + offset_minute * 60);
+  } else if unlikely (*p != 'Z' && *p != 'z') {
+    return 0;
+  }
+
+  return xmlParserEpoch(year, month, day, hour, minute, second, offset);
+}
+
+
+/* RFC 1123, e.g. Sun, 06 Nov 1994 08:49:37 GMT, some servers drop the
+ * leading zero of the day */
+static time_t xmlParserTimeRFC1123 (const char *p) {
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+  /* the day name is redundant */
+  p = strchr(p, ',');
+  if unlikely (p == NULL) {
+    return 0;
+  }
+  p++;
+  p += strspn(p, " \t");
+
+  int day, month = 0, year, hour, minute, second;
+  int day_digits = (unsigned int) p[0] - '0' <= 9 && (unsigned int) p[1] - '0' <= 9 ? 2 : 1;
+  if unlikely (!(xmlParserDigits(&p, day_digits, &day) && xmlParserExpect(&p, ' '))) {
+    return 0;
+  }
+  for (int i = 0; i < 12; i++) {
+    if (strncmp(p, months + i * 3, 3) == 0) {
+      month = i + 1;
+      break;
+    }
+  }
+  if unlikely (month == 0) {
+    return 0;
   }
+  p += 3;
+  if unlikely (!(xmlParserExpect(&p, ' ') &&
+                 xmlParserDigits(&p, 4, &year) && xmlParserExpect(&p, ' ') &&
+                 xmlParserDigits(&p, 2, &hour) && xmlParserExpect(&p, ':') &&
+                 xmlParserDigits(&p, 2, &minute) && xmlParserExpect(&p, ':') &&
+                 xmlParserDigits(&p, 2, &second))) {
+    return 0;
+  }
+  return xmlParserEpoch(year, month, day, hour, minute, second, 0);
+}
+
 
-  return 0;
+time_t xmlParserTime (const char *value, const char *dt) {
+  if (dt == NULL || strscmp(dt, "dateTime.") != 0) {
+    return 0;
+  }
+  if unlikely (value == NULL) {
+    return 0;
+  }
+
+  /* strptime skipped leading blanks, some servers pad their values */
+  value += strspn(value, " \t\r\n");
+
+  const char *format_name = dt + strlen("dateTime.");
+  if (strscmp(format_name, "tz") == 0) {
+    return xmlParserTimeISO8601(value);
+  } else if (strscmp(format_name, "rfc1123") == 0) {
+    return xmlParserTimeRFC1123(value);
+  } else {
+    fprintf(stderr, "Unknown time format %s\n", format_name);
+    return 0;
+  }
 }
 
 
@@ -71,3 +183,267 @@ size_t curl_parse_xml (char *ptr, size_t size, size_t nmemb, void *data) {
 
   return nmemb;
 }
+
+
+#define DAV_NONE ((size_t) -1)
+
+/* element depths inside a multistatus */
+enum {
+  DAV_DEPTH_MULTISTATUS = 1,
+  DAV_DEPTH_RESPONSE,
+  DAV_DEPTH_PROPSTAT,
+  DAV_DEPTH_PROP,
+  DAV_DEPTH_PROPERTY,
+  DAV_DEPTH_PROPERTY_CHILD,
+};
+
+
+static size_t DavMultistatus_intern (DavMultistatus *this, const char *s, size_t len) {
+  size_t offset = this->strings.offset;
+  Buffer_append((char *) s, 1, len, &this->strings);
+  Buffer_append("", 1, 1, &this->strings);
+  return offset;
+}
+
+
+static inline const char *DavMultistatus_string (const DavMultistatus *this, size_t offset) {
+  return offset == DAV_NONE ? NULL : this->strings.data + offset;
+}
+
+
+/* SAX2 names come from the parser dictionary, so they equal the interned
+ * names by pointer */
+static inline bool DavMultistatus_isdav (
+    const DavMultistatus *this, const xmlChar *localname, const xmlChar *URI, const xmlChar *name) {
+  return URI == this->names.dav && localname == name;
+}
+
+
+static enum DavPropKey DavMultistatus_lookup (
+    const DavMultistatus *this, const xmlChar *localname, const xmlChar *URI) {
+  for (enum DavPropKey key = 0; key < DAV_PROP_MAX; key++) {
+    if (localname == this->names.name[key] && URI == this->names.ns[key]) {
+      return key;
+    }
+  }
+  return DAV_PROP_MAX;
+}
+
+
+static void DavMultistatus_reset (DavMultistatus *this) {
+  this->strings.offset = 0;
+  for (enum DavPropKey key = 0; key < DAV_PROP_MAX; key++) {
+    this->props[key] = (struct DavPropOffset) {DAV_NONE, DAV_NONE, DAV_NONE};
+  }
+  this->propstat_props = 0;
+  this->prop = DAV_PROP_MAX;
+  this->href = DAV_NONE;
+  this->status = DAV_NONE;
+  this->found = false;
+}
+
+
+static void DavMultistatus_start (
+    void *ctx, const xmlChar *localname, const xmlChar *prefix, const xmlChar *URI,
+    int nb_namespaces, const xmlChar **namespaces,
+    int nb_attributes, int nb_defaulted, const xmlChar **attributes) {
+  DavMultistatus *this = (DavMultistatus *) ctx;
+  this->depth++;
+
+  switch (this->depth) {
+    case DAV_DEPTH_RESPONSE:
+      if (DavMultistatus_isdav(this, localname, URI, this->names.response)) {
+        DavMultistatus_reset(this);
+      }
+      break;
+    case DAV_DEPTH_PROPSTAT:
+      if (DavMultistatus_isdav(this, localname, URI, this->names.href)) {
+        this->href = this->strings.offset;
+        this->text_depth = this->depth;
+      } else if (DavMultistatus_isdav(this, localname, URI, this->names.propstat)) {
+        this->propstat_props = 0;
+        this->status = DAV_NONE;
+      }
+      break;
+    case DAV_DEPTH_PROP:
+      if (DavMultistatus_isdav(this, localname, URI, this->names.status)) {
+        this->status = this->strings.offset;
+        this->text_depth = this->depth;
+      }
+      break;
+    case DAV_DEPTH_PROPERTY: {
+      this->prop = DavMultistatus_lookup(this, localname, URI);
+      if (this->prop == DAV_PROP_MAX) {
+        break;
+      }
+      struct DavPropOffset *prop = &this->props[this->prop];
+      this->propstat_props |= 1U << this->prop;
+      prop->dt = DAV_NONE;
+      prop->child = DAV_NONE;
+      /* attributes come as localname/prefix/URI/value/end quintuples */
+      for (int i = 0; i < nb_attributes; i++) {
+        const xmlChar **attribute = attributes + i * 5;
+        if (attribute[0] == this->names.dt) {
+          prop->dt = DavMultistatus_intern(
+            this, (const char *) attribute[3], attribute[4] - attribute[3]);
+        }
+      }
+      prop->value = this->strings.offset;
+      this->text_depth = this->depth;
+      break;
+    }
+    case DAV_DEPTH_PROPERTY_CHILD:
+      if (this->text_depth == DAV_DEPTH_PROPERTY) {
+        /* terminate the value, only text before the first child counts */
+        Buffer_append("", 1, 1, &this->strings);
+        this->text_depth = 0;
+        struct DavPropOffset *prop = &this->props[this->prop];
+        if (prop->child == DAV_NONE) {
+          prop->child = DavMultistatus_intern(this, (const char *) localname, xmlStrlen(localname));
+        }
+      }
+      break;
+  }
+}
+
+
+static void DavMultistatus_end (
+    void *ctx, const xmlChar *localname, const xmlChar *prefix, const xmlChar *URI) {
+  DavMultistatus *this = (DavMultistatus *) ctx;
+
+  if (this->text_depth == this->depth) {
+    Buffer_append("", 1, 1, &this->strings);
+    this->text_depth = 0;
+  }
+
+  switch (this->depth) {
+    case DAV_DEPTH_RESPONSE:
+      /* a response without any readable property, e.g. a 404 propstat or
+       * a bare status, tells nothing about the resource */
+      if (this->href != DAV_NONE && this->found &&
+          DavMultistatus_isdav(this, localname, URI, this->names.response)) {
+        struct DavResponse response = {
+          .href = DavMultistatus_string(this, this->href),
+        };
+        for (enum DavPropKey key = 0; key < DAV_PROP_MAX; key++) {
+          response.props[key] = (struct DavProp) {
+            .value = DavMultistatus_string(this, this->props[key].value),
+            .dt = DavMultistatus_string(this, this->props[key].dt),
+            .child = DavMultistatus_string(this, this->props[key].child),
+          };
+        }
+        if unlikely (this->callback(this->data, &response) || Exception_has(&ex)) {
+          this->stopped = true;
+          xmlStopParser(this->ctxt);
+        }
+      }
+      DavMultistatus_reset(this);
+      break;
+    case DAV_DEPTH_PROPSTAT:
+      if (DavMultistatus_isdav(this, localname, URI, this->names.propstat)) {
+        /* only keep what the server could read */
+        const char *status = DavMultistatus_string(this, this->status);
+        if (status && (strstr(status, " 403") || strstr(status, " 409"))) {
+          this->refused |= this->propstat_props;
+        }
+        if (status && strstr(status, " 200")) {
+          this->found = true;
+        } else {
+          for (enum DavPropKey key = 0; key < DAV_PROP_MAX; key++) {
+            if (this->propstat_props & (1U << key)) {
+              this->props[key] = (struct DavPropOffset) {DAV_NONE, DAV_NONE, DAV_NONE};
+            }
+          }
+        }
+      }
+      break;
+  }
+
+  this->depth--;
+}
+
+
+static void DavMultistatus_characters (void *ctx, const xmlChar *ch, int len) {
+  DavMultistatus *this = (DavMultistatus *) ctx;
+  if (this->text_depth != 0 && this->text_depth == this->depth) {
+    Buffer_append((char *) ch, 1, len, &this->strings);
+  }
+}
+
+
+static void DavMultistatus_error (void *ctx, xmlErrorPtr error) {
+  /* reported by DavMultistatus_finish() */
+}
+
+
+static xmlSAXHandler DavMultistatus_sax = {
+  .initialized = XML_SAX2_MAGIC,
+  .startElementNs = DavMultistatus_start,
+  .endElementNs = DavMultistatus_end,
+  .characters = DavMultistatus_characters,
+  .cdataBlock = DavMultistatus_characters,
+  .serror = DavMultistatus_error,
+};
+
+
+size_t curl_parse_multistatus (char *ptr, size_t size, size_t nmemb, void *data) {
+  DavMultistatus *this = (DavMultistatus *) data;
+  if unlikely (this->stopped) {
+    return 0;
+  }
+  /* a malformed body is only an error for a 207, see DavMultistatus_finish */
+  if likely (this->ctxt->wellFormed) {
+    xmlParseChunk(this->ctxt, ptr, nmemb, 0);
+  }
+  return nmemb;
+}
+
+
+bool DavMultistatus_finish (DavMultistatus *this) {
+  if likely (!this->stopped && this->ctxt->wellFormed) {
+    xmlParseChunk(this->ctxt, NULL, 0, 1);
+  }
+  return this->ctxt->wellFormed;
+}
+
+
+void DavMultistatus_destory (DavMultistatus *this) {
+  PROTECT_RETURN(this);
+
+  xmlFreeParserCtxt(this->ctxt);
+  Buffer_destory(&this->strings);
+}
+
+
+int DavMultistatus_init (DavMultistatus *this, DavResponse_callback_t callback, void *data) {
+  this->callback = callback;
+  this->data = data;
+  this->depth = 0;
+  this->text_depth = 0;
+  this->stopped = false;
+  this->refused = 0;
+  this->ctxt = NULL;
+  this->strings = (Buffer) {0};
+  DavMultistatus_reset(this);
+
+  do_once {
+    throwable Buffer(&this->strings, 512);
+    this->ctxt = xmlCreatePushParserCtxt(&DavMultistatus_sax, this, NULL, 0, NULL);
+    condition_throw(this->ctxt) MallocException("xmlCreatePushParserCtxt");
+    xmlCtxtUseOptions(this->ctxt, XML_PARSE_NONET);
+
+    xmlDictPtr dict = this->ctxt->dict;
+    this->names.dav = xmlDictLookup(dict, BAD_CAST DAV_XML_NS, -1);
+    this->names.response = xmlDictLookup(dict, BAD_CAST "response", -1);
+    this->names.href = xmlDictLookup(dict, BAD_CAST "href", -1);
+    this->names.propstat = xmlDictLookup(dict, BAD_CAST "propstat", -1);
+    this->names.status = xmlDictLookup(dict, BAD_CAST "status", -1);
+    this->names.dt = xmlDictLookup(dict, BAD_CAST "dt", -1);
+#define X(space, local) \
+    this->names.ns[DAV_PROP_ ## space ## _ ## local] = xmlDictLookup(dict, BAD_CAST space ## _XML_NS, -1); \
+    this->names.name[DAV_PROP_ ## space ## _ ## local] = xmlDictLookup(dict, BAD_CAST #local, -1);
+    DAV_PROPS
+#undef X
+  }
+  return TEST_SUCCESS;
+}
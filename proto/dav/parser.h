@@ -1,11 +1,14 @@
 #ifndef PROTO_DAV_PARSER_H
 #define PROTO_DAV_PARSER_H
 
+#include <stdbool.h>
 #include <time.h>
 
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 
+#include <template/buffer.h>
+
 #ifndef LIBXML_PUSH_ENABLED
   #error "Library not compiled with push parser support"
 #endif
@@ -13,9 +16,112 @@
 
 #define xmlStrscmp(str1, str2) xmlStrncmp(str1, str2, strlen((const char *) str2))
 
+#define DAV_XML_NS "DAV:"
+#define NETWORKFS_XML_NS "NETWORKFS:"
+
+/* properties understood in a multistatus, anything else is skipped */
+#define DAV_PROPS \
+  X(DAV, resourcetype) \
+  X(DAV, creationdate) \
+  X(DAV, getlastmodified) \
+  X(DAV, getcontentlength) \
+  X(DAV, getetag) \
+  X(NETWORKFS, mode) \
+  X(NETWORKFS, size) \
+  X(NETWORKFS, owner) \
+  X(NETWORKFS, time) \
+  X(NETWORKFS, target) \
+
+enum DavPropKey {
+#define X(ns, name) DAV_PROP_ ## ns ## _ ## name,
+  DAV_PROPS
+#undef X
+  DAV_PROP_MAX
+};
+
+/* mask of the NETWORKFS: properties */
+#define DAV_PROPS_NETWORKFS ( \
+  1U << DAV_PROP_NETWORKFS_mode | 1U << DAV_PROP_NETWORKFS_size | 1U << DAV_PROP_NETWORKFS_owner | \
+  1U << DAV_PROP_NETWORKFS_time | 1U << DAV_PROP_NETWORKFS_target)
+
+
+/* A property of a successful propstat, `value` is NULL if absent. `dt` is
+ * the data type attribute, `child` the name of the first child element
+ * (e.g. "collection"). */
+struct DavProp {
+  const char *value;
+  const char *dt;
+  const char *child;
+};
+
+/* One <D:response> of a multistatus, valid during the callback only */
+struct DavResponse {
+  const char *href;
+  struct DavProp props[DAV_PROP_MAX];
+};
+
+/* returns nonzero to stop the parser */
+typedef int (*DavResponse_callback_t) (void *data, const struct DavResponse *response);
 
-time_t xmlParserTimeNode (xmlNode * const node);
+/* Streaming multistatus parser. Each response is passed to the callback
+ * as soon as its closing tag is parsed, no tree is built, so memory is
+ * bounded by the largest response. Once the callback stops it, or throws,
+ * the rest of the body is refused so the transfer is aborted. */
+typedef struct DavMultistatus {
+  xmlParserCtxtPtr ctxt;
+  DavResponse_callback_t callback;
+  void *data;
+
+  /* names interned in the parser dictionary, so elements are matched by
+   * pointer */
+  struct {
+    const xmlChar *dav;
+    const xmlChar *response;
+    const xmlChar *href;
+    const xmlChar *propstat;
+    const xmlChar *status;
+    const xmlChar *dt;
+    const xmlChar *ns[DAV_PROP_MAX];
+    const xmlChar *name[DAV_PROP_MAX];
+  } names;
+
+  /* strings of the current response, referenced by offset since the
+   * buffer moves when it grows */
+  Buffer strings;
+  struct DavPropOffset {
+    size_t value;
+    size_t dt;
+    size_t child;
+  } props[DAV_PROP_MAX];
+  /* properties set by the current propstat */
+  unsigned int propstat_props;
+  /* property being parsed, DAV_PROP_MAX for none */
+  enum DavPropKey prop;
+  size_t href;
+  size_t status;
+  /* a propstat of the current response had status 200 */
+  bool found;
+
+  int depth;
+  /* depth of the element whose text is being collected, 0 for none */
+  int text_depth;
+  /* stopped by the callback */
+  bool stopped;
+  /* properties a propstat of any response refused with 403 or 409 */
+  unsigned int refused;
+} DavMultistatus;
+
+_Static_assert(DAV_PROP_MAX <= sizeof(unsigned int) * 8, "too many properties");
+
+
+time_t xmlParserTime (const char *value, const char *dt);
 size_t curl_parse_xml (char *ptr, size_t size, size_t nmemb, void *data);
 
+size_t curl_parse_multistatus (char *ptr, size_t size, size_t nmemb, void *data);
+bool DavMultistatus_finish (DavMultistatus *this);
+void DavMultistatus_destory (DavMultistatus *this);
+int DavMultistatus_init (DavMultistatus *this, DavResponse_callback_t callback, void *data);
+#define DavMultistatus(...) DavMultistatus_init(__VA_ARGS__)
+
 
 #endif /* PROTO_DAV_PARSER_H */